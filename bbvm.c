@@ -0,0 +1,322 @@
+/*
+	MIT License
+
+	Copyright (c) 2024 Ivan
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+// Runs bytecode written by `brainbrain --bytecode` on stdin and stdout.
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bytecode.h"
+
+static uint32_t read_le(const uint8_t* bytes, size_t size)
+{
+	uint32_t value = 0;
+	for (size_t i = 0; i < size; i++)
+	{
+		value |= (uint32_t)bytes[i] << (8 * i);
+	}
+	return value;
+}
+
+static uint8_t read_input(void)
+{
+	int c = getchar();
+	return (c == EOF) ? 0 : (uint8_t)c;
+}
+
+// Bytes of operands that follow every opcode, BC_MUL has more after its count.
+static const uint8_t operand_sizes[BC_COUNT] = {
+	[BC_HALT] = 0,
+	[BC_INC] = 1,
+	[BC_SHIFT] = 2,
+	[BC_INC_SHIFT] = 3,
+	[BC_CLEAR] = 0,
+	[BC_CLEAR_SHIFT] = 2,
+	[BC_MUL] = 1,
+	[BC_SCAN] = 2,
+	[BC_READ] = 0,
+	[BC_WRITE] = 0,
+	[BC_ECHO] = 1,
+	[BC_MAP] = 4,
+	[BC_PRINT] = 4,
+	[BC_JZ] = 4,
+	[BC_JNZ] = 4,
+};
+
+// Checks that every instruction, shift and table is in bounds and that every
+// jump lands on the start of an instruction, so that run() doesn't have to.
+// starts has a byte for every byte of code, all zero, and is left 1 at the
+// start of every instruction and 2 at the start of every jump.
+static int validate(const uint8_t* code, uint32_t code_size, const uint8_t* data, uint32_t data_size, uint32_t tape, uint8_t* starts)
+{
+	uint32_t pc = 0;
+	uint32_t last = 0;
+	while (pc < code_size)
+	{
+		uint8_t opcode = code[pc];
+		if (opcode >= BC_COUNT || code_size - pc - 1 < operand_sizes[opcode]) return 0;
+		const uint8_t* operands = code + pc + 1;
+		uint32_t size = 1 + operand_sizes[opcode];
+		switch (opcode)
+		{
+		case BC_SHIFT: case BC_CLEAR_SHIFT: case BC_SCAN: {
+			if (read_le(operands, 2) >= tape) return 0;
+		} break;
+		case BC_INC_SHIFT: {
+			if (read_le(operands + 1, 2) >= tape) return 0;
+		} break;
+		case BC_MUL: {
+			uint32_t count = operands[0];
+			if ((code_size - pc - size) / 3 < count) return 0;
+			for (uint32_t i = 0; i < count; i++)
+			{
+				if (read_le(operands + 1 + 3 * i, 2) >= tape) return 0;
+			}
+			size += 3 * count;
+		} break;
+		case BC_MAP: {
+			uint32_t offset = read_le(operands, 4);
+			uint32_t table = 256 + 256 * 4;
+			if (offset > data_size || data_size - offset < table) return 0;
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t start = read_le(data + offset + 256 + 4 * i, 4);
+				uint32_t length = data[offset + i];
+				if (start > data_size - offset - table || data_size - offset - table - start < length) return 0;
+			}
+		} break;
+		case BC_PRINT: {
+			uint32_t offset = read_le(operands, 4);
+			if (offset > data_size || data_size - offset < 3) return 0;
+			if (data_size - offset - 3 < read_le(data + offset + 1, 2)) return 0;
+		} break;
+		default: break;
+		}
+		starts[pc] = (opcode == BC_JZ || opcode == BC_JNZ) ? 2 : 1;
+		last = pc;
+		pc += size;
+	}
+	if (code_size == 0 || code[last] != BC_HALT) return 0;
+	// Jumps are checked once all starts are known.
+	for (pc = 0; pc < code_size; pc++)
+	{
+		if (starts[pc] != 2) continue;
+		uint32_t target = read_le(code + pc + 1, 4);
+		if (target >= code_size || starts[target] == 0) return 0;
+	}
+	return 1;
+}
+
+#if defined(__GNUC__)
+// Computed goto gives every instruction its own indirect branch.
+#define DISPATCH() goto *labels[code[pc]]
+#define CASE(opcode) label_##opcode
+#else
+#define DISPATCH() continue
+#define CASE(opcode) case opcode
+#endif
+
+static void run(const uint8_t* code, const uint8_t* data, uint8_t* cells, uint32_t tape)
+{
+	uint32_t pc = 0;
+	uint32_t ptr = 0;
+#if defined(__GNUC__)
+	static void* labels[BC_COUNT] = {
+		[BC_HALT] = &&label_BC_HALT,
+		[BC_INC] = &&label_BC_INC,
+		[BC_SHIFT] = &&label_BC_SHIFT,
+		[BC_INC_SHIFT] = &&label_BC_INC_SHIFT,
+		[BC_CLEAR] = &&label_BC_CLEAR,
+		[BC_CLEAR_SHIFT] = &&label_BC_CLEAR_SHIFT,
+		[BC_MUL] = &&label_BC_MUL,
+		[BC_SCAN] = &&label_BC_SCAN,
+		[BC_READ] = &&label_BC_READ,
+		[BC_WRITE] = &&label_BC_WRITE,
+		[BC_ECHO] = &&label_BC_ECHO,
+		[BC_MAP] = &&label_BC_MAP,
+		[BC_PRINT] = &&label_BC_PRINT,
+		[BC_JZ] = &&label_BC_JZ,
+		[BC_JNZ] = &&label_BC_JNZ,
+	};
+	DISPATCH();
+#else
+	while (1) switch (code[pc])
+	{
+#endif
+	CASE(BC_INC):
+		cells[ptr] += code[pc + 1];
+		pc += 2;
+		DISPATCH();
+	CASE(BC_SHIFT):
+		ptr += read_le(code + pc + 1, 2);
+		if (ptr >= tape) ptr -= tape;
+		pc += 3;
+		DISPATCH();
+	CASE(BC_INC_SHIFT):
+		cells[ptr] += code[pc + 1];
+		ptr += read_le(code + pc + 2, 2);
+		if (ptr >= tape) ptr -= tape;
+		pc += 4;
+		DISPATCH();
+	CASE(BC_CLEAR):
+		cells[ptr] = 0;
+		pc += 1;
+		DISPATCH();
+	CASE(BC_CLEAR_SHIFT):
+		cells[ptr] = 0;
+		ptr += read_le(code + pc + 1, 2);
+		if (ptr >= tape) ptr -= tape;
+		pc += 3;
+		DISPATCH();
+	CASE(BC_MUL): {
+		uint32_t count = code[pc + 1];
+		uint8_t value = cells[ptr];
+		for (uint32_t i = 0; i < count && value != 0; i++)
+		{
+			const uint8_t* entry = code + pc + 2 + 3 * i;
+			uint32_t target = ptr + read_le(entry, 2);
+			if (target >= tape) target -= tape;
+			cells[target] += (uint8_t)(value * entry[2]);
+		}
+		cells[ptr] = 0;
+		pc += 2 + 3 * count;
+		DISPATCH();
+	}
+	CASE(BC_SCAN): {
+		uint32_t shift = read_le(code + pc + 1, 2);
+		while (cells[ptr] != 0)
+		{
+			ptr += shift;
+			if (ptr >= tape) ptr -= tape;
+		}
+		pc += 3;
+		DISPATCH();
+	}
+	CASE(BC_READ):
+		cells[ptr] = read_input();
+		pc += 1;
+		DISPATCH();
+	CASE(BC_WRITE):
+		putchar(cells[ptr]);
+		pc += 1;
+		DISPATCH();
+	CASE(BC_ECHO): {
+		uint8_t write_first = code[pc + 1];
+		while (cells[ptr] != 0)
+		{
+			if (write_first) putchar(cells[ptr]);
+			cells[ptr] = read_input();
+			if (!write_first) putchar(cells[ptr]);
+		}
+		pc += 2;
+		DISPATCH();
+	}
+	CASE(BC_MAP): {
+		const uint8_t* table = data + read_le(code + pc + 1, 4);
+		const uint8_t* bytes = table + 256 + 256 * 4;
+		while (cells[ptr] != 0)
+		{
+			uint8_t value = cells[ptr];
+			fwrite(bytes + read_le(table + 256 + 4 * value, 4), 1, table[value], stdout);
+			cells[ptr] = read_input();
+		}
+		pc += 5;
+		DISPATCH();
+	}
+	CASE(BC_PRINT): {
+		const uint8_t* run = data + read_le(code + pc + 1, 4);
+		uint32_t count = read_le(run + 1, 2);
+		for (uint32_t i = 0; i < count; i++)
+		{
+			putchar((uint8_t)(cells[ptr] + run[3 + i]));
+		}
+		cells[ptr] += run[0];
+		pc += 5;
+		DISPATCH();
+	}
+	CASE(BC_JZ):
+		pc = (cells[ptr] == 0) ? read_le(code + pc + 1, 4) : pc + 5;
+		DISPATCH();
+	CASE(BC_JNZ):
+		pc = (cells[ptr] != 0) ? read_le(code + pc + 1, 4) : pc + 5;
+		DISPATCH();
+	CASE(BC_HALT):
+		return;
+#if !defined(__GNUC__)
+	}
+#endif
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <bytecode>\n", (argc >= 1) ? argv[0] : "bbvm");
+		return 1;
+	}
+	FILE* file = fopen(argv[1], "rb");
+	if (file == NULL)
+	{
+		fprintf(stderr, "error: Failed to open %s.\n", argv[1]);
+		return 1;
+	}
+	uint8_t header[BYTECODE_HEADER_SIZE];
+	if (fread(header, 1, sizeof(header), file) != sizeof(header)
+		|| memcmp(header, BYTECODE_MAGIC, 4) != 0
+		|| read_le(header + 4, 4) != BYTECODE_VERSION)
+	{
+		fprintf(stderr, "error: %s is not bytecode of version %d.\n", argv[1], BYTECODE_VERSION);
+		return 1;
+	}
+	uint32_t tape = read_le(header + 8, 4);
+	uint32_t code_size = read_le(header + 12, 4);
+	uint32_t data_size = read_le(header + 16, 4);
+	uint8_t* code = malloc((size_t)code_size + 1);
+	uint8_t* data = malloc((size_t)data_size + 1);
+	uint8_t* cells = calloc((size_t)tape + 1, 1);
+	uint8_t* starts = calloc((size_t)code_size + 1, 1);
+	if (code == NULL || data == NULL || cells == NULL || starts == NULL)
+	{
+		fprintf(stderr, "error: Out of memory.\n");
+		return 1;
+	}
+	if (fread(code, 1, code_size, file) != code_size
+		|| fread(data, 1, data_size, file) != data_size
+		|| tape == 0
+		|| !validate(code, code_size, data, data_size, tape, starts))
+	{
+		fprintf(stderr, "error: %s is corrupted.\n", argv[1]);
+		return 1;
+	}
+	fclose(file);
+	free(starts);
+	run(code, data, cells, tape);
+	fflush(stdout);
+	free(code);
+	free(data);
+	free(cells);
+	return 0;
+}
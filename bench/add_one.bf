@@ -0,0 +1,3 @@
+Adds one to every input byte up to the first zero byte or the end of input
+a stream map workload
+,[+.,]
@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Writes synthetic stress workloads to stdout:
+// ops N - straight line source of N ops that do not merge with each other,
+// nest N - loops nested N deep around a single decrement,
+// text N - N bytes of pseudo random lowercase text with no zero bytes.
+static int write_ops(unsigned long long count)
+{
+	static const char pattern[] = "+>-<";
+	for (unsigned long long i = 0; i < count; i++)
+	{
+		if (putchar(pattern[i % 4]) == EOF) return 0;
+		if (i % 64 == 63 && putchar('\n') == EOF) return 0;
+	}
+	return putchar('\n') != EOF;
+}
+
+static int write_nest(unsigned long long depth)
+{
+	if (putchar('+') == EOF) return 0;
+	for (unsigned long long i = 0; i < depth; i++)
+	{
+		if (putchar('[') == EOF) return 0;
+	}
+	if (putchar('-') == EOF) return 0;
+	for (unsigned long long i = 0; i < depth; i++)
+	{
+		if (putchar(']') == EOF) return 0;
+	}
+	return putchar('\n') != EOF;
+}
+
+static int write_text(unsigned long long size)
+{
+	unsigned long long state = 1;
+	for (unsigned long long i = 0; i < size; i++)
+	{
+		state = state * 6364136223846793005ull + 1442695040888963407ull;
+		unsigned value = (unsigned)(state >> 59);
+		char c = (i % 64 == 63) ? '\n' : (value < 26) ? (char)('a' + value) : ' ';
+		if (putchar(c) == EOF) return 0;
+	}
+	return 1;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "Usage: %s ops|nest|text <count>\n", argv[0]);
+		return 1;
+	}
+	char* end;
+	unsigned long long count = strtoull(argv[2], &end, 10);
+	if (*end != '\0')
+	{
+		fprintf(stderr, "error: Bad count %s.\n", argv[2]);
+		return 1;
+	}
+	int ok =
+		(strcmp(argv[1], "ops") == 0) ? write_ops(count) :
+		(strcmp(argv[1], "nest") == 0) ? write_nest(count) :
+		(strcmp(argv[1], "text") == 0) ? write_text(count) :
+		(fprintf(stderr, "error: Unknown workload %s.\n", argv[1]), 0);
+	if (fflush(stdout) != 0) ok = 0;
+	return ok ? 0 : 1;
+}
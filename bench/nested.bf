@@ -0,0 +1,3 @@
+Runs three nested loops of 255 iterations each and prints the byte 255
+which is the innermost count modulo 256
+-[>-[>-[>+<-]<-]<-]>>>.
@@ -0,0 +1,8 @@
+Prints the numbers from 1 to 255 in decimal with leading zeros using divmod
+by ten; a small loop and arithmetic heavy workload written for this suite
+-[>+[->+>+<<]>>[-<<+>>]++++++++++<[->-[>+>>]>[+[-
+<+>]>+>>]<<<<<]>>>>++++++++++<[->-[>+>>]>[+[-
+<+>]>+>>]<<<<<]>>>++++++++++++++++++++++++++++++++++++++++++++++
+++.[-]<++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]<<<++++++++++++++++++++++++++++++++++++++++++++++++.[-
+]>>>>>++++++++++.[-]<<<<<<[-]>>>[-]<<<<<<-]
@@ -0,0 +1,63 @@
+# Generates the synthetic workloads, then compiles every program of the
+# suite to assembly and benchmarks it with --bench, writing the JSON
+# results to RESULTS_DIR.
+#
+# Expects BRAINBRAIN, BFGEN, BENCH_DIR, RESULTS_DIR, RUNS, OPS, NEST and TEXT.
+
+file(REMOVE_RECURSE "${RESULTS_DIR}")
+file(MAKE_DIRECTORY "${RESULTS_DIR}")
+
+foreach(workload ops nest text)
+	string(TOUPPER ${workload} count)
+	set(output "${RESULTS_DIR}/${workload}.bf")
+	if(workload STREQUAL "text")
+		set(output "${RESULTS_DIR}/text.txt")
+	endif()
+	execute_process(
+		COMMAND "${BFGEN}" ${workload} ${${count}}
+		OUTPUT_FILE "${output}"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "bfgen ${workload} failed")
+	endif()
+endforeach()
+
+# Program and the input it reads.
+set(suite
+	"${BENCH_DIR}/nested.bf" /dev/null
+	"${BENCH_DIR}/numbers.bf" /dev/null
+	"${BENCH_DIR}/add_one.bf" "${RESULTS_DIR}/text.txt"
+	"${BENCH_DIR}/shift_copy.bf" "${RESULTS_DIR}/text.txt"
+	"${BENCH_DIR}/../examples/echo.bf" "${RESULTS_DIR}/text.txt"
+	"${BENCH_DIR}/../examples/hello.bf" /dev/null
+	"${RESULTS_DIR}/ops.bf" /dev/null
+	"${RESULTS_DIR}/nest.bf" /dev/null)
+
+list(LENGTH suite length)
+math(EXPR last "${length} - 1")
+foreach(i RANGE 0 ${last} 2)
+	math(EXPR j "${i} + 1")
+	list(GET suite ${i} program)
+	list(GET suite ${j} input)
+	get_filename_component(name "${program}" NAME_WE)
+	foreach(level O1 O0)
+		set(flags)
+		if(level STREQUAL "O0")
+			set(flags -O0)
+		endif()
+		execute_process(
+			COMMAND "${BRAINBRAIN}" ${flags} -o "${RESULTS_DIR}/${name}.${level}.asm" "${program}"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "brainbrain ${flags} failed to compile ${program}")
+		endif()
+		execute_process(
+			COMMAND "${BRAINBRAIN}" ${flags} --bench "${program}" --input "${input}" --runs ${RUNS}
+			OUTPUT_FILE "${RESULTS_DIR}/${name}.${level}.json"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "brainbrain ${flags} --bench failed on ${program}")
+		endif()
+		message(STATUS "${name} ${level}: ${RESULTS_DIR}/${name}.${level}.json")
+	endforeach()
+endforeach()
@@ -0,0 +1,3 @@
+Writes every input byte followed by the byte 32 above it up to the first
+zero byte or the end of input
+,[.>++++[<++++++++>-]<.[-],]
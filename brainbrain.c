@@ -22,6 +22,10 @@
 	SOFTWARE.
 */
 
+#if defined(__linux__)
+#define _GNU_SOURCE // For fopencookie().
+#endif
+
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,9 +33,75 @@
 #include <string.h>
 #include <inttypes.h>
 #include <errno.h>
+#include <time.h>
+#include <stdarg.h>
+
+#include "bytecode.h"
+
+#if defined(__x86_64__) && defined(__linux__)
+#define JIT_SUPPORTED 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+#if defined(__unix__)
+#define IR_CACHE_MMAP 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define IR_CACHE_MMAP 0
+#endif
+
+#if defined(__unix__)
+#define RUNNER_SUPPORTED 1
+#include <pthread.h>
+#include <unistd.h>
+#else
+#define RUNNER_SUPPORTED 0
+#endif
+
+#if defined(__unix__) && defined(__GLIBC__)
+#define PIPELINE_SUPPORTED 1
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio_ext.h>
+#include <sys/types.h>
+#else
+#define PIPELINE_SUPPORTED 0
+#endif
+
+#if defined(__unix__)
+#define FORK_SERVER_SUPPORTED 1
+#include <sys/wait.h>
+#include <unistd.h>
+#else
+#define FORK_SERVER_SUPPORTED 0
+#endif
+
+#if defined(__linux__) && defined(__GLIBC__)
+#define COUNTED_OUTPUT_SUPPORTED 1
+#include <sys/types.h>
+#else
+#define COUNTED_OUTPUT_SUPPORTED 0
+#endif
+
+#if defined(__linux__)
+#define BENCH_SUPPORTED 1
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <linux/perf_event.h>
+#else
+#define BENCH_SUPPORTED 0
+#endif
 
 #define BF_MEMORY_SIZE 3000
 #define BF_MEMORY_SIZE_STR "3000"
+#define BF_IO_BUFFER_SIZE_STR "65536"
 
 #include <assert.h>
 #define ASSERT(x) assert(x)
@@ -66,6 +136,128 @@ static void crash_multiple_targets(void)
 	exit(1);
 }
 
+static void crash_profile_needs_native_target(void)
+{
+	fprintf(stderr, "error: Profiling is only supported for assembly targets.\n");
+	exit(1);
+}
+
+static void crash_debug_info_needs_native_target(void)
+{
+	fprintf(stderr, "error: Line info is only supported for assembly targets.\n");
+	exit(1);
+}
+
+static void crash_profile_needs_program(void)
+{
+	fprintf(stderr, "error: Profiling is only supported for --libc and --linux programs.\n");
+	exit(1);
+}
+
+static void crash_bad_embed_name(void)
+{
+	fprintf(stderr, "error: --embed name must be a non-empty C identifier.\n");
+	exit(1);
+}
+
+static void crash_bad_split_flag(void)
+{
+	fprintf(stderr, "error: --split must be given a positive number of parts, like --split=4.\n");
+	exit(1);
+}
+
+static void crash_split_needs_program(void)
+{
+	fprintf(stderr, "error: --split is only supported for --libc and --linux programs written with -o.\n");
+	exit(1);
+}
+
+static void crash_shared_needs_embed(void)
+{
+	fprintf(stderr, "error: --shared is only supported with --embed.\n");
+	exit(1);
+}
+
+static void crash_header_needs_embed(void)
+{
+	fprintf(stderr, "error: --header is only supported with --embed.\n");
+	exit(1);
+}
+
+static void crash_run_with_output(void)
+{
+	fprintf(stderr, "error: Programs run with --run don't have an output file or profile.\n");
+	exit(1);
+}
+
+static void crash_bad_bench_flag(const char* flag)
+{
+	fprintf(stderr, "error: %s flag must be followed by a value.\n", flag);
+	exit(1);
+}
+
+#if !BENCH_SUPPORTED
+static void crash_bench_not_supported(void)
+{
+	fprintf(stderr, "error: --bench is only supported on linux.\n");
+	exit(1);
+}
+#endif
+
+static void crash_bad_runner_flag(const char* flag)
+{
+	fprintf(stderr, "error: %s flag must be followed by a positive number.\n", flag);
+	exit(1);
+}
+
+static void crash_too_many_lanes(void)
+{
+	fprintf(stderr, "error: --lanes can be at most 64.\n");
+	exit(1);
+}
+
+#if !RUNNER_SUPPORTED
+static void crash_runner_not_supported(void)
+{
+	fprintf(stderr, "error: --runner is only supported on unix.\n");
+	exit(1);
+}
+#endif
+
+#if !PIPELINE_SUPPORTED
+static void crash_pipeline_not_supported(void)
+{
+	fprintf(stderr, "error: --pipeline is only supported on unix with glibc.\n");
+	exit(1);
+}
+#endif
+
+static void crash_pipeline_too_short(void)
+{
+	fprintf(stderr, "error: --pipeline needs at least one program.\n");
+	exit(1);
+}
+
+#if !FORK_SERVER_SUPPORTED
+static void crash_fork_server_not_supported(void)
+{
+	fprintf(stderr, "error: --fork-server is only supported on unix.\n");
+	exit(1);
+}
+#endif
+
+static void crash_fork_server_with_heatmap(void)
+{
+	fprintf(stderr, "error: --fork-server can't be used with --heatmap.\n");
+	exit(1);
+}
+
+static void crash_bad_print_profile_flag(void)
+{
+	fprintf(stderr, "error: --print-profile flag must be followed by a profile path.\n");
+	exit(1);
+}
+
 static void crash_alloc_failed(void)
 {
 	fprintf(stderr, "error: Failed to allocate enough memory.\n");
@@ -79,6 +271,58 @@ static void crash_bad_bf(void)
 	exit(1);
 }
 
+static void print_json_string(FILE* file, const char* string)
+{
+	fputc('"', file);
+	for (const char* c = string; *c != '\0'; c++)
+	{
+		if (*c == '"' || *c == '\\') fprintf(file, "\\%c", *c);
+		else if ((unsigned char)*c < 0x20) fprintf(file, "\\u%04x", (unsigned char)*c);
+		else fputc(*c, file);
+	}
+	fputc('"', file);
+}
+
+// Optimization decisions written as JSON lines to file.
+typedef struct Remarks Remarks;
+struct Remarks
+{
+	FILE* file;
+	const char* source_path;
+};
+
+// Reports that pass was applied, or missed, to the source between
+// line:column and end_line:end_column. Does nothing if remarks is NULL.
+static void remark(
+	Remarks* remarks,
+	const char* pass,
+	int applied,
+	uint32_t line,
+	uint32_t column,
+	uint32_t end_line,
+	uint32_t end_column,
+	const char* format,
+	...)
+{
+	if (remarks == NULL) return;
+	char message[256];
+	va_list args;
+	va_start(args, format);
+	vsnprintf(message, sizeof(message), format, args);
+	va_end(args);
+	fprintf(remarks->file, "{\"pass\": \"%s\", \"status\": \"%s\", \"file\": ", pass, applied ? "applied" : "missed");
+	print_json_string(remarks->file, remarks->source_path);
+	fprintf(
+		remarks->file,
+		", \"line\": %" PRIu32 ", \"column\": %" PRIu32 ", \"end_line\": %" PRIu32 ", \"end_column\": %" PRIu32 ", \"message\": ",
+		line,
+		column,
+		end_line,
+		end_column);
+	print_json_string(remarks->file, message);
+	fprintf(remarks->file, "}\n");
+}
+
 typedef uint8_t OpTag;
 enum
 {
@@ -86,6 +330,10 @@ enum
 	OP_TAG_SHIFT,
 	OP_TAG_READ,
 	OP_TAG_WRITE,
+	OP_TAG_ECHO,
+	OP_TAG_MAP,
+	OP_TAG_PRINT,
+	OP_TAG_COUNT,
 };
 
 typedef struct OpInc OpInc;
@@ -100,14 +348,74 @@ struct OpShift
 	uint16_t index;
 };
 
+// Lowered `[.,]` (write_first = 1) or `[,.]` (write_first = 0) loop.
+// Copies input to output until a zero byte or EOF and leaves the cell zeroed.
+typedef struct OpEcho OpEcho;
+struct OpEcho
+{
+	uint8_t write_first;
+};
+
+typedef struct Block Block;
+
+typedef uint8_t BlockHeat;
+enum
+{
+	BLOCK_HEAT_NORMAL,
+	BLOCK_HEAT_HOT,
+	BLOCK_HEAT_COLD,
+};
+
+// Lowered loop that outputs a pure function of the cell and then reads the cell,
+// until the cell is zero or input reaches EOF.
+typedef struct StreamMap StreamMap;
+struct StreamMap
+{
+	uint8_t lengths[UINT8_MAX + 1];
+	uint32_t offsets[UINT8_MAX + 1];
+	size_t size;
+	uint8_t* bytes;
+	Block* loop; // The original loop, emitted by TARGET_BF.
+};
+
+typedef struct OpMap OpMap;
+struct OpMap
+{
+	StreamMap* map;
+};
+
+#define PRINT_MAX_COUNT 256
+
+// Batched writes of one cell with known increments between them.
+// Writes cell + deltas[i] for every delta, then adds inc to the cell.
+typedef struct PrintRun PrintRun;
+struct PrintRun
+{
+	uint8_t inc;
+	size_t count;
+	uint8_t deltas[PRINT_MAX_COUNT];
+};
+
+typedef struct OpPrint OpPrint;
+struct OpPrint
+{
+	PrintRun* run;
+};
+
 typedef struct Op Op;
 struct Op
 {
 	OpTag tag;
+	// Source position of the first command of the op.
+	uint32_t line;
+	uint32_t column;
 	union
 	{
 		OpInc inc;
 		OpShift shift;
+		OpEcho echo;
+		OpMap map;
+		OpPrint print;
 	} as;
 };
 
@@ -119,12 +427,21 @@ struct Ops
 	Op* items;
 };
 
-typedef struct Block Block;
 struct Block
 {
 	Block* next;
 	Block* exit;
 	Ops ops;
+	// Source position of the `[` or `]` that starts the block.
+	uint32_t line;
+	uint32_t column;
+	// Hash of the commands of the loop body for loop heads, of the loop
+	// that ends right before the block otherwise. Stable under edits
+	// outside of the loop, so profiles can find the block again.
+	uint64_t hash;
+	BlockHeat heat;
+	// Number of the labels of a loop head in its EmitRegion, set while emitting.
+	uint32_t label;
 };
 
 typedef struct Blocks Blocks;
@@ -188,15 +505,66 @@ static void block_append_op(Block* block, Op op)
 	block->ops.items[block->ops.count++] = op;
 }
 
-static Block* parse(const char* src)
+#define PARSE_HASH_BASE 1099511628211u
+
+static uint64_t hash_power(uint64_t exponent)
+{
+	uint64_t base = PARSE_HASH_BASE;
+	uint64_t power = 1;
+	for (; exponent != 0; exponent >>= 1)
+	{
+		if (exponent & 1) power *= base;
+		base *= base;
+	}
+	return power;
+}
+
+static uint64_t hash_mix(uint64_t hash)
+{
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdu;
+	hash ^= hash >> 33;
+	return hash;
+}
+
+// Reports commands of the block that block_append_op() merged, if any.
+static void remark_merged(Remarks* remarks, Block* block, size_t commands, uint32_t end_line, uint32_t end_column)
+{
+	if (commands <= block->ops.count) return;
+	remark(
+		remarks,
+		"merge",
+		1,
+		block->line,
+		block->column,
+		end_line,
+		end_column,
+		"merged %zu commands into %zu ops",
+		commands,
+		block->ops.count);
+}
+
+static Block* parse(const char* src, Remarks* remarks)
 {
 	Block* root = calloc(1, sizeof(Block));
 	if (root == NULL) crash_alloc_failed();
+	root->line = 1;
+	root->column = 1;
 	Block* block = root;
 	Blocks unclosed = {0};
+	uint32_t line = 1;
+	uint32_t column = 0;
+	// Polynomial hash of every command so far and the number of commands,
+	// a loop body is hashed from their values at its `[` and `]`.
+	uint64_t hash = 0;
+	uint64_t commands = 0;
+	uint64_t* opened = NULL;
+	size_t opened_capacity = 0;
+	size_t block_commands = 0;
 
 	for (const char* c = src; *c != '\0'; c++)
 	{
+		column++;
 		switch (*c)
 		{
 		case '+': case '-': 
@@ -210,284 +578,787 @@ static Block* parse(const char* src)
 				(*c == ',') ? (Op){ .tag = OP_TAG_READ } :
 				(*c == '.') ? (Op){ .tag = OP_TAG_WRITE } :
 				(ASSERT(0), (Op){0});
+			tag.line = line;
+			tag.column = column;
 			block_append_op(block, tag);
+			block_commands++;
 		} break;
 		case '[': {
+			remark_merged(remarks, block, block_commands, line, column);
+			block_commands = 0;
 			Block* next = calloc(1, sizeof(Block));
 			if (next == NULL) crash_alloc_failed();
+			next->line = line;
+			next->column = column;
 			block->next = next;
 			block = block->next;
 			blocks_push(&unclosed, block);
+			if (opened_capacity != unclosed.capacity)
+			{
+				opened_capacity = unclosed.capacity;
+				opened = realloc(opened, opened_capacity * 2 * sizeof(uint64_t));
+				if (opened == NULL) crash_alloc_failed();
+			}
+			opened[2 * (unclosed.count - 1)] = hash * PARSE_HASH_BASE + (uint8_t)*c;
+			opened[2 * (unclosed.count - 1) + 1] = commands + 1;
 		} break;
 		case ']': {
+			remark_merged(remarks, block, block_commands, line, column);
+			block_commands = 0;
 			Block* backedge = blocks_pop(&unclosed);
+			uint64_t start_hash = opened[2 * unclosed.count];
+			uint64_t start_commands = opened[2 * unclosed.count + 1];
+			backedge->hash = hash_mix(hash - start_hash * hash_power(commands - start_commands));
 			Block* next = calloc(1, sizeof(Block));
 			if (next == NULL) crash_alloc_failed();
+			next->line = line;
+			next->column = column;
+			next->hash = hash_mix(backedge->hash + 1);
 			backedge->exit = next;
 			block = next;
 		} break;
+		case '\n': {
+			line++;
+			column = 0;
+		} break;
+		default: break;
+		}
+		switch (*c)
+		{
+		case '+': case '-': case '>': case '<':
+		case '.': case ',': case '[': case ']': {
+			hash = hash * PARSE_HASH_BASE + (uint8_t)*c;
+			commands++;
+		} break;
 		default: break;
 		}
 	}
 
 	if (unclosed.count != 0) crash_bad_bf();
+	remark_merged(remarks, block, block_commands, line, column);
 	free(unclosed.items);
+	free(opened);
 	return root;
 }
 
-typedef enum Target Target;
-enum Target
+#define SIM_PREFIX_STEPS (1 << 20)
+#define SIM_MAP_STEPS (1 << 16)
+#define SIM_MAX_DEPTH 256
+
+// Compile time execution of the program on a partially known tape.
+// A strict simulation fails on anything that depends on unknown cells or on
+// input, and stops right before the op at stop_index of stop_block.
+typedef struct Sim Sim;
+struct Sim
 {
-	TARGET_NOT_SELECTED = 0,
-	TARGET_BF,
-	TARGET_NASM_LIBC,
-	TARGET_NASM_LINUX,
+	size_t ptr;
+	size_t steps;
+	int strict;
+	int stopped;
+	Block* stop_block;
+	size_t stop_index;
+	size_t output_count;
+	uint8_t output[UINT8_MAX];
+	uint8_t known[BF_MEMORY_SIZE];
+	uint8_t cells[BF_MEMORY_SIZE];
 };
 
-static int print_tab(size_t count, FILE* file)
+static int sim_ops(Sim* sim, Block* block)
 {
+	size_t count = (block == sim->stop_block) ? sim->stop_index : block->ops.count;
 	for (size_t i = 0; i < count; i++)
 	{
-		if (fputs("    ", file) == EOF) return 0;
+		if (sim->steps == 0) return 0;
+		sim->steps--;
+		Op op = block->ops.items[i];
+		size_t ptr = sim->ptr;
+		switch (op.tag)
+		{
+		case OP_TAG_INC: {
+			if (sim->strict && !sim->known[ptr]) return 0;
+			sim->cells[ptr] += op.as.inc.value;
+		} break;
+		case OP_TAG_SHIFT: {
+			sim->ptr = (ptr + op.as.shift.index) % BF_MEMORY_SIZE;
+		} break;
+		case OP_TAG_READ: {
+			if (sim->strict) return 0;
+			sim->known[ptr] = 0;
+		} break;
+		case OP_TAG_WRITE: {
+			if (!sim->strict) break;
+			if (!sim->known[ptr] || sim->output_count == sizeof(sim->output)) return 0;
+			sim->output[sim->output_count++] = sim->cells[ptr];
+		} break;
+		case OP_TAG_PRINT: {
+			PrintRun* run = op.as.print.run;
+			if (sim->strict)
+			{
+				if (!sim->known[ptr] || sim->output_count + run->count > sizeof(sim->output)) return 0;
+				for (size_t j = 0; j < run->count; j++)
+				{
+					sim->output[sim->output_count++] = sim->cells[ptr] + run->deltas[j];
+				}
+			}
+			sim->cells[ptr] += run->inc;
+		} break;
+		case OP_TAG_ECHO: case OP_TAG_MAP: {
+			// Both leave the cell zeroed and do not touch any other cell.
+			if (sim->strict) return 0;
+			sim->cells[ptr] = 0;
+			sim->known[ptr] = 1;
+		} break;
+		default: {
+			ASSERT(0);
+		} break;
+		}
 	}
+	if (block == sim->stop_block) sim->stopped = 1;
 	return 1;
 }
 
-static int emit_file_head(FILE* file, Target target)
+static int sim_chain(Sim* sim, Block* block, size_t depth);
+
+static int sim_block(Sim* sim, Block* block, size_t depth)
 {
-	switch (target)
+	if (block->exit == NULL) return sim_ops(sim, block);
+	if (depth > SIM_MAX_DEPTH) return 0;
+	while (!sim->stopped)
 	{
-	case TARGET_BF: break;
-	case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			"global _start\n"
-			"\n"
-			"section .bss\n"
-			"tmp resd 1\n"
-			"\n"
-			"section .data\n"
-			"mem db " BF_MEMORY_SIZE_STR " dup(0)\n"
-			"\n"
-			"section .text\n"
-			"_start:\n"
-			"xor r12, r12\n"
-		) < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: {
-		if (fprintf(
-			file,
-			"default rel\n"
-			"global main\n"
-			"extern putchar\n"
-			"extern getchar\n"
-			"extern exit\n"
-			"\n"
-			"section .bss\n"
-			"mem resb " BF_MEMORY_SIZE_STR "\n"
-			"\n"
-			"section .text\n"
-			"main:\n"
-			"push rbp\n"
-			"mov rbp, rsp\n"
-			"xor r12, r12\n"
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
+		if (sim->steps == 0 || !sim->known[sim->ptr]) return 0;
+		sim->steps--;
+		if (sim->cells[sim->ptr] == 0) break;
+		if (!sim_ops(sim, block)) return 0;
+		if (!sim_chain(sim, block->next, depth + 1)) return 0;
 	}
 	return 1;
 }
 
-static int emit_file_tail(FILE* file, Target target)
+static int sim_chain(Sim* sim, Block* block, size_t depth)
 {
-	switch (target)
+	while (block != NULL && !sim->stopped)
 	{
-	case TARGET_BF: break;
-	case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			"mov eax, 1\n"
-			"mov ebx, 0\n"
-			"int 80h\n"
-		) < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: {
-		if (fprintf(
-			file,
-			"mov rdi, 0\n"
-			"call exit wrt ..plt\n"
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
+		if (!sim_block(sim, block, depth)) return 0;
+		block = (block->exit != NULL) ? block->exit : block->next;
 	}
 	return 1;
 }
 
-static int emit_loop_head(Block* loop, size_t layer, FILE* file, Target target)
+static void loop_lower_to(Block* loop, Op op)
 {
-	switch (target)
-	{
-	case TARGET_BF: {
-		if (!print_tab(layer, file)) return 0;
-		if (fprintf(file, "[\n") < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			".loop_%p:\n"
-			"lea rax, [rel mem]\n"
-			"cmp byte [rax + r12], 0\n"
-			"je .end_%p\n",
-			loop,
-			loop
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
-	}
-	return 1;
+	// The body is dropped, the loop becomes a plain block with a single op.
+	ASSERT(loop->exit != NULL);
+	loop->ops.count = 0;
+	op.line = loop->line;
+	op.column = loop->column;
+	block_append_op(loop, op);
+	loop->next = loop->exit;
+	loop->exit = NULL;
 }
 
-static int emit_loop_tail(Block* loop, size_t layer, FILE* file, Target target)
+// Drops increments right before a read, the read overwrites the cell.
+static void remove_dead_incs(Block* block, Remarks* remarks)
 {
-	switch (target)
+	Ops* ops = &block->ops;
+	size_t count = 0;
+	for (size_t i = 0; i < ops->count; i++)
 	{
-	case TARGET_BF: {
-		if (!print_tab(layer - 1, file)) return 0;
-		if (fprintf(file, "]\n") < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			"jmp .loop_%p\n"
-			".end_%p:\n",
-			loop,
-			loop
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
+		Op op = ops->items[i];
+		if (op.tag == OP_TAG_INC
+			&& i + 1 < ops->count
+			&& ops->items[i + 1].tag == OP_TAG_READ)
+		{
+			remark(remarks, "dead-inc", 1, op.line, op.column, op.line, op.column, "removed increment overwritten by a read");
+			continue;
+		}
+		ops->items[count++] = ops->items[i];
 	}
-	return 1;
+	ops->count = count;
 }
 
-static int inc_signed_count(OpInc inc)
+// Replaces runs of writes of the same cell, with only increments
+// between them, by a single print of all the bytes.
+static void batch_writes(Block* block, Remarks* remarks)
 {
-	int32_t count = inc.value;
-	if (count > INT8_MAX) count = -((int32_t)UINT8_MAX - count + 1);
-	return (int)count;
+	Ops* ops = &block->ops;
+	size_t count = 0;
+	size_t i = 0;
+	while (i < ops->count)
+	{
+		PrintRun run = {0};
+		size_t end = i;
+		uint8_t value = 0;
+		for (size_t j = i; j < ops->count && run.count < PRINT_MAX_COUNT; j++)
+		{
+			Op op = ops->items[j];
+			if (op.tag == OP_TAG_INC) value += op.as.inc.value;
+			else if (op.tag == OP_TAG_WRITE)
+			{
+				run.deltas[run.count++] = value;
+				run.inc = value;
+				end = j + 1;
+			}
+			else break;
+		}
+		if (ops->items[i].tag != OP_TAG_WRITE || run.count < 2)
+		{
+			ops->items[count++] = ops->items[i++];
+			continue;
+		}
+		PrintRun* batched = malloc(sizeof(PrintRun));
+		if (batched == NULL) crash_alloc_failed();
+		*batched = run;
+		remark(
+			remarks,
+			"batch-writes",
+			1,
+			ops->items[i].line,
+			ops->items[i].column,
+			ops->items[end - 1].line,
+			ops->items[end - 1].column,
+			"batched %zu writes into one buffered write",
+			run.count);
+		ops->items[count++] = (Op){
+			.tag = OP_TAG_PRINT,
+			.line = ops->items[i].line,
+			.column = ops->items[i].column,
+			.as.print.run = batched
+		};
+		i = end;
+	}
+	ops->count = count;
 }
 
-static int emit_op_inc(OpInc inc, size_t layer, FILE* file, Target target)
+static int lower_echo_loop(Block* loop)
 {
-	switch (target)
+	if (loop->next != NULL || loop->ops.count != 2) return 0;
+	OpTag first = loop->ops.items[0].tag;
+	OpTag second = loop->ops.items[1].tag;
+	if (first == OP_TAG_WRITE && second == OP_TAG_READ)
 	{
-	case TARGET_BF: {
-		if (!print_tab(layer, file)) return 0;
-		int count = inc_signed_count(inc);
-		for (int i = count; i > 0; i--)
+		loop_lower_to(loop, (Op){ .tag = OP_TAG_ECHO, .as.echo.write_first = 1 });
+		return 1;
+	}
+	if (first == OP_TAG_READ && second == OP_TAG_WRITE)
+	{
+		loop_lower_to(loop, (Op){ .tag = OP_TAG_ECHO, .as.echo.write_first = 0 });
+		return 1;
+	}
+	return 0;
+}
+
+static Block* loop_last_block(Block* loop)
+{
+	if (loop->next == NULL) return loop;
+	Block* block = loop->next;
+	while (1)
+	{
+		if (block->exit != NULL) block = block->exit;
+		else if (block->next != NULL) block = block->next;
+		else return block;
+	}
+}
+
+// Lowers a loop whose every iteration writes a function of the cell and ends
+// by reading the cell back, given the state of the tape at loop entry.
+// The function is evaluated for every nonzero cell value at compile time.
+// Sets why to the reason if the loop is not lowered.
+static int lower_map_loop(Block* loop, const Sim* prefix, const char** why)
+{
+	Block* last = loop_last_block(loop);
+	Ops* ops = &last->ops;
+	// The read must end the iteration, so that EOF (read as 0) ends the loop.
+	*why = "the body does not end with a read";
+	if (ops->count == 0) return 0;
+	size_t read = ops->count - 1;
+	if (ops->items[read].tag != OP_TAG_READ) return 0;
+
+	StreamMap* map = calloc(1, sizeof(StreamMap));
+	if (map == NULL) crash_alloc_failed();
+	Sim* sim = malloc(sizeof(Sim));
+	if (sim == NULL) crash_alloc_failed();
+	for (size_t value = 1; value <= UINT8_MAX; value++)
+	{
+		memcpy(sim, prefix, sizeof(Sim));
+		sim->strict = 1;
+		sim->stopped = 0;
+		sim->steps = SIM_MAP_STEPS;
+		sim->stop_block = last;
+		sim->stop_index = read;
+		sim->output_count = 0;
+		sim->cells[sim->ptr] = (uint8_t)value;
+		sim->known[sim->ptr] = 1;
+		*why = "the body can't be simulated for every cell value";
+		if (!sim_ops(sim, loop)) goto fail;
+		if (!sim_chain(sim, loop->next, 1)) goto fail;
+		if (!sim->stopped) goto fail;
+		*why = "the body moves the pointer or changes other cells";
+		if (sim->ptr != prefix->ptr) goto fail;
+
+		// Every cell but the loop cell must be back to its state at loop entry.
+		sim->cells[sim->ptr] = prefix->cells[sim->ptr];
+		sim->known[sim->ptr] = prefix->known[sim->ptr];
+		if (memcmp(sim->known, prefix->known, sizeof(sim->known)) != 0) goto fail;
+		if (memcmp(sim->cells, prefix->cells, sizeof(sim->cells)) != 0) goto fail;
+
+		map->lengths[value] = (uint8_t)sim->output_count;
+		map->offsets[value] = (uint32_t)map->size;
+		if (sim->output_count != 0)
 		{
-			if (fprintf(file, "+") < 0) return 0;
+			map->bytes = realloc(map->bytes, map->size + sim->output_count);
+			if (map->bytes == NULL) crash_alloc_failed();
+			memcpy(map->bytes + map->size, sim->output, sim->output_count);
+			map->size += sim->output_count;
 		}
-		for (int i = -count; i > 0; i--)
+	}
+	free(sim);
+
+	Block* original = calloc(1, sizeof(Block));
+	if (original == NULL) crash_alloc_failed();
+	original->exit = calloc(1, sizeof(Block));
+	if (original->exit == NULL) crash_alloc_failed();
+	original->ops = loop->ops;
+	original->next = loop->next;
+	loop->ops = (Ops){0};
+	map->loop = original;
+	loop_lower_to(loop, (Op){ .tag = OP_TAG_MAP, .as.map.map = map });
+	return 1;
+fail:
+	free(sim);
+	free(map->bytes);
+	free(map);
+	return 0;
+}
+
+// The prefix is the state of the tape at loop entry,
+// it is only known for top level loops.
+static int lower_loop(Block* loop, const Sim* prefix, int top, Remarks* remarks)
+{
+	uint32_t end_line = loop->exit->line;
+	uint32_t end_column = loop->exit->column;
+	const char* why;
+	if (lower_echo_loop(loop))
+	{
+		remark(remarks, "echo", 1, loop->line, loop->column, end_line, end_column, "lowered to a buffered copy of input to output");
+		return 1;
+	}
+	if (!top) why = "the loop is nested, so the tape at loop entry is unknown";
+	else if (prefix == NULL) why = "the tape at loop entry depends on input or takes too long to simulate";
+	else if (lower_map_loop(loop, prefix, &why))
+	{
+		remark(remarks, "map", 1, loop->line, loop->column, end_line, end_column, "lowered to a table driven stream map");
+		return 1;
+	}
+	remark(remarks, "loop", 0, loop->line, loop->column, end_line, end_column, "stayed a loop: %s", why);
+	return 0;
+}
+
+#if RUNNER_SUPPORTED
+
+// Items of one worker of a pool. The worker takes them from the bottom,
+// idle workers steal them from the top.
+typedef struct WorkQueue WorkQueue;
+struct WorkQueue
+{
+	pthread_mutex_t lock;
+	size_t* items;
+	size_t top;
+	size_t bottom;
+};
+
+// Deals the items round robin, so that each worker takes its own in order.
+// Without items, the items are 0 to item_count - 1.
+static WorkQueue* work_queues_create(const size_t* items, size_t item_count, size_t worker_count)
+{
+	WorkQueue* queues = calloc(worker_count, sizeof(WorkQueue));
+	if (queues == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < worker_count; i++)
+	{
+		WorkQueue* queue = &queues[i];
+		pthread_mutex_init(&queue->lock, NULL);
+		queue->items = malloc((item_count / worker_count + 1) * sizeof(size_t));
+		if (queue->items == NULL) crash_alloc_failed();
+		// Pushed in reverse, the bottom is taken first.
+		for (size_t item = item_count; item-- > 0;)
 		{
-			if (fprintf(file, "-") < 0) return 0;
+			if (item % worker_count == i) queue->items[queue->bottom++] = (items != NULL) ? items[item] : item;
 		}
-		if (fprintf(file, "\n") < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			"lea rbx, [rel mem]\n"
-			"mov al, [rbx + r12]\n"
-			"add al, %" PRIu8 "\n"
-			"mov [rbx + r12], al\n",
-			inc.value
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
 	}
-	return 1;
+	return queues;
 }
 
+static void work_queues_destroy(WorkQueue* queues, size_t worker_count)
+{
+	for (size_t i = 0; i < worker_count; i++)
+	{
+		pthread_mutex_destroy(&queues[i].lock);
+		free(queues[i].items);
+	}
+	free(queues);
+}
 
-static int shift_signed_count(OpShift shift)
+static int work_take(WorkQueue* queues, size_t worker_count, size_t self, size_t* item)
 {
-	int32_t count = shift.index;
-	if (count > BF_MEMORY_SIZE / 2) count = -((int32_t)BF_MEMORY_SIZE - count);
-	return (int)count;
+	for (size_t i = 0; i < worker_count; i++)
+	{
+		WorkQueue* queue = &queues[(self + i) % worker_count];
+		pthread_mutex_lock(&queue->lock);
+		int found = queue->top < queue->bottom;
+		if (found) *item = (i == 0) ? queue->items[--queue->bottom] : queue->items[queue->top++];
+		pthread_mutex_unlock(&queue->lock);
+		if (found) return 1;
+	}
+	return 0;
 }
 
-static int emit_op_shift(OpShift shift, size_t layer, FILE* file, Target target)
+#endif
+
+// Optimizes the blocks nested in loop, which already is.
+// Nested loops never see a known tape, so nests are independent of each other.
+static void optimize_nest(Block* loop, Remarks* remarks)
 {
-	switch (target)
+	Blocks loops = {0};
+	blocks_push(&loops, loop);
+	Block* block = loop->next;
+	while (1)
 	{
-	case TARGET_BF: {
-		if (!print_tab(layer, file)) return 0;
-		int count = shift_signed_count(shift);
-		for (int i = count; i > 0; i--)
+		if (block == NULL)
 		{
-			if (fprintf(file, ">") < 0) return 0;
+			Block* done = blocks_pop(&loops);
+			if (done == loop) break;
+			block = done->exit;
+			continue;
 		}
-		for (int i = -count; i > 0; i--)
+		remove_dead_incs(block, remarks);
+		batch_writes(block, remarks);
+		if (block->exit != NULL && !lower_loop(block, NULL, 0, remarks)) blocks_push(&loops, block);
+		block = block->next;
+	}
+	free(loops.items);
+}
+
+// A top level loop whose nest optimize_parallel() hands to a worker.
+typedef struct OptimizeTask OptimizeTask;
+struct OptimizeTask
+{
+	Block* loop;
+	// Remarks of the top level up to and including the loop, then of its nest.
+	char* before;
+	size_t before_size;
+	char* nest;
+	size_t nest_size;
+};
+
+#if RUNNER_SUPPORTED
+
+typedef struct OptimizeWorker OptimizeWorker;
+struct OptimizeWorker
+{
+	OptimizeTask* tasks;
+	WorkQueue* queues;
+	size_t worker_count;
+	size_t index;
+	const Remarks* remarks; // NULL if there are none.
+	pthread_t thread;
+};
+
+static void* optimize_worker(void* argument)
+{
+	OptimizeWorker* worker = argument;
+	size_t index;
+	while (work_take(worker->queues, worker->worker_count, worker->index, &index))
+	{
+		OptimizeTask* task = &worker->tasks[index];
+		if (worker->remarks == NULL)
 		{
-			if (fprintf(file, "<") < 0) return 0;
+			optimize_nest(task->loop, NULL);
+			continue;
+		}
+		Remarks remarks = { .file = open_memstream(&task->nest, &task->nest_size), .source_path = worker->remarks->source_path };
+		if (remarks.file == NULL) crash_alloc_failed();
+		optimize_nest(task->loop, &remarks);
+		fclose(remarks.file);
+	}
+	return NULL;
+}
+
+#endif
+
+// The top level runs first, in order, since every loop there depends on the
+// simulated tape left by the ones before it. The nests of the loops that stay
+// loops are then optimized on up to thread_count threads, and their remarks
+// are written in the order of a serial run.
+static void optimize_parallel(Block* block, Remarks* remarks, size_t thread_count)
+{
+#if !RUNNER_SUPPORTED
+	thread_count = 1;
+#endif
+	int deferred = thread_count > 1;
+	OptimizeTask* tasks = NULL;
+	size_t task_count = 0;
+	Remarks top_remarks = {0};
+	char* tail = NULL;
+	size_t tail_size = 0;
+	Remarks* current = remarks;
+	if (deferred && remarks != NULL)
+	{
+#if RUNNER_SUPPORTED
+		top_remarks = (Remarks){ .file = open_memstream(&tail, &tail_size), .source_path = remarks->source_path };
+		if (top_remarks.file == NULL) crash_alloc_failed();
+		current = &top_remarks;
+#endif
+	}
+
+	Sim* prefix = calloc(1, sizeof(Sim));
+	if (prefix == NULL) crash_alloc_failed();
+	memset(prefix->known, 1, sizeof(prefix->known));
+	prefix->steps = SIM_PREFIX_STEPS;
+	while (block != NULL)
+	{
+		remove_dead_incs(block, current);
+		batch_writes(block, current);
+		int nested = block->exit != NULL && !lower_loop(block, prefix, 1, current);
+		if (prefix != NULL && !sim_block(prefix, block, 0))
+		{
+			// The rest of the program depends on input or takes too long to simulate.
+			free(prefix);
+			prefix = NULL;
+		}
+		if (!nested)
+		{
+			block = block->next;
+			continue;
+		}
+		if (!deferred) optimize_nest(block, remarks);
+		else
+		{
+			tasks = realloc(tasks, (task_count + 1) * sizeof(OptimizeTask));
+			if (tasks == NULL) crash_alloc_failed();
+			tasks[task_count] = (OptimizeTask){ .loop = block };
+#if RUNNER_SUPPORTED
+			if (remarks != NULL)
+			{
+				fclose(top_remarks.file);
+				tasks[task_count].before = tail;
+				tasks[task_count].before_size = tail_size;
+				top_remarks.file = open_memstream(&tail, &tail_size);
+				if (top_remarks.file == NULL) crash_alloc_failed();
+			}
+#endif
+			task_count++;
+		}
+		block = block->exit;
+	}
+	free(prefix);
+
+#if RUNNER_SUPPORTED
+	if (deferred)
+	{
+		size_t worker_count = (thread_count < task_count) ? thread_count : task_count;
+		if (worker_count == 0) worker_count = 1;
+		OptimizeWorker* workers = calloc(worker_count, sizeof(OptimizeWorker));
+		if (workers == NULL) crash_alloc_failed();
+		WorkQueue* queues = work_queues_create(NULL, task_count, worker_count);
+		int* started = calloc(worker_count, sizeof(int));
+		if (started == NULL) crash_alloc_failed();
+		for (size_t i = 0; i < worker_count; i++)
+		{
+			workers[i] = (OptimizeWorker){ .tasks = tasks, .queues = queues, .worker_count = worker_count, .index = i, .remarks = remarks };
+			if (i != 0) started[i] = pthread_create(&workers[i].thread, NULL, optimize_worker, &workers[i]) == 0;
+		}
+		// Tasks of workers that failed to start are stolen by the others.
+		optimize_worker(&workers[0]);
+		for (size_t i = 1; i < worker_count; i++)
+		{
+			if (started[i]) pthread_join(workers[i].thread, NULL);
+		}
+		free(started);
+		work_queues_destroy(queues, worker_count);
+		free(workers);
+		if (remarks != NULL)
+		{
+			fclose(top_remarks.file);
+			for (size_t i = 0; i < task_count; i++)
+			{
+				fwrite(tasks[i].before, 1, tasks[i].before_size, remarks->file);
+				fwrite(tasks[i].nest, 1, tasks[i].nest_size, remarks->file);
+				free(tasks[i].before);
+				free(tasks[i].nest);
+			}
+			fwrite(tail, 1, tail_size, remarks->file);
+			free(tail);
 		}
-		if (fprintf(file, "\n") < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
-		if (fprintf(
-			file,
-			"add r12w, %" PRIu16 "\n"
-			"xor dx, dx\n"
-			"mov ax, r12w\n"
-			"mov bx, " BF_MEMORY_SIZE_STR  "\n"
-			"div bx\n"
-			"mov r12w, dx\n",
-			shift.index
-		) < 0) return 0;
-	} break;
-	default: {
-		ASSERT(0);
-	} break;
+	}
+#endif
+	free(tasks);
+}
+
+static void optimize(Block* block, Remarks* remarks)
+{
+	optimize_parallel(block, remarks, 1);
+}
+
+typedef enum Target Target;
+enum Target
+{
+	TARGET_NOT_SELECTED = 0,
+	TARGET_BF,
+	TARGET_NASM_LIBC,
+	TARGET_NASM_LINUX,
+	TARGET_NASM_EMBED,
+	TARGET_BYTECODE,
+};
+
+// TARGET_NASM_EMBED emits `int bf_<name>(uint8_t* tape, size_t tape_len, const bf_io* io)`,
+// see emit_embed_header(). The tape is in r13 and everything else the program
+// needs lives in a frame on the stack, at r15, so calls are reentrant:
+//     EMBED_IO       const bf_io*
+//     EMBED_IN_POS   next byte of EMBED_IN_BUF
+//     EMBED_IN_END   end of the bytes read into EMBED_IN_BUF
+//     EMBED_OUT_LEN  bytes waiting in EMBED_OUT_BUF
+// Output is passed to io->write a buffer at a time and flushed before io->read.
+#define EMBED_IO 0
+#define EMBED_IN_POS 8
+#define EMBED_IN_END 16
+#define EMBED_OUT_LEN 24
+#define EMBED_IN_BUF 40
+#define EMBED_BUF_SIZE 4096
+#define EMBED_OUT_BUF (EMBED_IN_BUF + EMBED_BUF_SIZE)
+// Batched writes store whole 16 byte vectors past the end of the output.
+#define EMBED_FRAME_SIZE (EMBED_OUT_BUF + EMBED_BUF_SIZE + 16)
+// Offsets of the bf_io fields.
+#define EMBED_IO_CONTEXT 0
+#define EMBED_IO_READ 8
+#define EMBED_IO_WRITE 16
+// Return values of the emitted function.
+#define EMBED_OK 0
+#define EMBED_ERROR_TAPE 1
+#define EMBED_ERROR_WRITE 2
+#define EMBED_ERROR_ABI 3
+// Checked by bf_init() of --shared modules, changes with the bf_io struct
+// and the calling convention of bf_run().
+#define EMBED_ABI_VERSION 1
+
+static int print_tab(size_t count, FILE* file)
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		if (fputs("    ", file) == EOF) return 0;
 	}
 	return 1;
 }
 
-static int emit_op_read(FILE* file, size_t layer, Target target)
+static int emit_file_head(FILE* file, Target target, const char* embed_name, int shared)
 {
 	switch (target)
 	{
-	case TARGET_BF: {
-		if (!print_tab(layer, file)) return 0;
-		if (fprintf(file, ",\n") < 0) return 0;
+	case TARGET_BF: break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"global _start\n"
+			"\n"
+			"section .bss\n"
+			"tmp resd 1\n"
+			"\n"
+			"section .data\n"
+			"mem db " BF_MEMORY_SIZE_STR " dup(0)\n"
+			"\n"
+			"section .text\n"
+			"_start:\n"
+			"xor r12, r12\n"
+		) < 0) return 0;
 	} break;
 	case TARGET_NASM_LIBC: {
 		if (fprintf(
 			file,
-			"call getchar wrt ..plt\n"
-			"lea rbx, [rel mem]\n"
-			"mov [rbx + r12], al\n"
+			"default rel\n"
+			"global main\n"
+			"extern putchar\n"
+			"extern exit\n"
+			"extern read\n"
+			"extern fflush\n"
+			"extern fwrite\n"
+			"extern memchr\n"
+			"extern stdout\n"
+			"\n"
+			"section .bss\n"
+			"mem resb " BF_MEMORY_SIZE_STR "\n"
+			"\n"
+			"section .text\n"
+			"main:\n"
+			"push rbp\n"
+			"mov rbp, rsp\n"
+			"xor r12, r12\n"
 		) < 0) return 0;
 	} break;
-	case TARGET_NASM_LINUX: {
+	case TARGET_NASM_EMBED: {
+		// Five pushes after rbp and the frame leave rsp 16 byte aligned.
+		ASSERT(EMBED_FRAME_SIZE % 16 == 8);
+		// Shared modules also export the same entry point as bf_run, so hosts
+		// can look up every module by the same names.
+		if (shared && fprintf(
+			file,
+			"default rel\n"
+			"global bf_init:function\n"
+			"global bf_run:function\n"
+			"global bf_%s:function\n"
+			"\n"
+			"section .text\n"
+			"bf_init:\n"
+			"mov eax, %d\n"
+			"cmp edi, %d\n"
+			"jne .done\n"
+			"test rsi, rsi\n"
+			"jz .ok\n"
+			"mov qword [rsi], " BF_MEMORY_SIZE_STR "\n"
+			".ok:\n"
+			"xor eax, eax\n"
+			".done:\n"
+			"ret\n"
+			"\n"
+			"bf_run:\n",
+			embed_name,
+			EMBED_ERROR_ABI,
+			EMBED_ABI_VERSION
+		) < 0) return 0;
+		if (!shared && fprintf(
+			file,
+			"default rel\n"
+			"global bf_%s\n"
+			"\n"
+			"section .text\n",
+			embed_name
+		) < 0) return 0;
 		if (fprintf(
 			file,
-			"mov eax, 0x3\n"
-			"mov ebx, 0x1\n"
-			"mov ecx, tmp\n"
-			"mov edx, 0x1\n"
-			"int 80h\n"
-			"mov eax, [tmp]\n"
-			"mov [mem + r12], al\n"
+			"bf_%s:\n"
+			"push rbp\n"
+			"mov rbp, rsp\n"
+			"push rbx\n"
+			"push r12\n"
+			"push r13\n"
+			"push r14\n"
+			"push r15\n"
+			"sub rsp, %d\n"
+			"mov r15, rsp\n"
+			"mov eax, %d\n"
+			"cmp rsi, " BF_MEMORY_SIZE_STR "\n"
+			"jb bb_exit\n"
+			"mov r13, rdi\n"
+			"mov [r15 + %d], rdx\n"
+			"xor eax, eax\n"
+			"mov [r15 + %d], rax\n"
+			"mov [r15 + %d], rax\n"
+			"mov [r15 + %d], rax\n"
+			"xor r12, r12\n",
+			embed_name,
+			EMBED_FRAME_SIZE,
+			EMBED_ERROR_TAPE,
+			EMBED_IO,
+			EMBED_IN_POS,
+			EMBED_IN_END,
+			EMBED_OUT_LEN
 		) < 0) return 0;
 	} break;
 	default: {
@@ -497,142 +1368,4616 @@ static int emit_op_read(FILE* file, size_t layer, Target target)
 	return 1;
 }
 
-static int emit_op_write(FILE* file, size_t layer, Target target)
+// Input is read in large chunks into bb_in_buf, so that lowered loops
+// can process it in bulk and still share it with single byte reads.
+// EOF reads as 0, so that lowered loops may stop there like the originals do.
+static int emit_runtime(FILE* file, Target target)
 {
 	switch (target)
 	{
-	case TARGET_BF: {
-		if (!print_tab(layer, file)) return 0;
-		if (fprintf(file, ".\n") < 0) return 0;
-	} break;
-	case TARGET_NASM_LIBC: {
-		if (fprintf(
-			file,
-			"xor rdi, rdi\n"
-			"lea rbx, [rel mem]\n"
-			"mov dil, [rbx + r12]\n"
-			"call putchar wrt ..plt\n"
-		) < 0) return 0;
-	} break;
+	case TARGET_BF: break;
 	case TARGET_NASM_LINUX: {
 		if (fprintf(
 			file,
+			"\n"
+			"section .bss\n"
+			"bb_in_buf resb " BF_IO_BUFFER_SIZE_STR "\n"
+			"bb_in_pos resq 1\n"
+			"bb_in_end resq 1\n"
+			"\n"
+			"section .text\n"
+			"bb_fill:\n"
 			"xor eax, eax\n"
-			"mov al, [mem + r12]\n"
-			"mov [tmp], eax\n"
-			"mov eax, 0x4\n"
-			"mov ebx, 0x1\n"
-			"mov ecx, tmp\n"
-			"mov edx, 0x1\n"
+			"xor edi, edi\n"
+			"lea rsi, [rel bb_in_buf]\n"
+			"mov edx, " BF_IO_BUFFER_SIZE_STR "\n"
+			"syscall\n"
+			"test rax, rax\n"
+			"jg .ok\n"
+			"xor eax, eax\n"
+			".ok:\n"
+			"mov [rel bb_in_end], rax\n"
+			"mov qword [rel bb_in_pos], 0\n"
+			"ret\n"
+			"\n"
+			"bb_write:\n"
+			"test rdx, rdx\n"
+			"jz .done\n"
+			"mov eax, 1\n"
+			"mov edi, 1\n"
+			"syscall\n"
+			"test rax, rax\n"
+			"jle .done\n"
+			"add rsi, rax\n"
+			"sub rdx, rax\n"
+			"jmp bb_write\n"
+			".done:\n"
+			"ret\n"
+			"\n"
+			"bb_read:\n"
+			"mov rax, [rel bb_in_pos]\n"
+			"cmp rax, [rel bb_in_end]\n"
+			"jb .ready\n"
+			"call bb_fill\n"
+			"test rax, rax\n"
+			"jz .eof\n"
+			"xor eax, eax\n"
+			".ready:\n"
+			"lea rcx, [rel bb_in_buf]\n"
+			"movzx ecx, byte [rcx + rax]\n"
+			"inc rax\n"
+			"mov [rel bb_in_pos], rax\n"
+			"mov eax, ecx\n"
+			"ret\n"
+			".eof:\n"
+			"xor eax, eax\n"
+			"ret\n"
+			"\n"
+			"bb_echo:\n"
+			"test dil, dil\n"
+			"jz .skip\n"
+			"push rbx\n"
+			"mov ebx, esi\n"
+			"test ebx, ebx\n"
+			"jz .next\n"
+			"mov [rel tmp], dil\n"
+			"lea rsi, [rel tmp]\n"
+			"mov edx, 1\n"
+			"call bb_write\n"
+			".next:\n"
+			"mov rax, [rel bb_in_pos]\n"
+			"cmp rax, [rel bb_in_end]\n"
+			"jb .scan\n"
+			"call bb_fill\n"
+			"test rax, rax\n"
+			"jz .eof\n"
+			"xor eax, eax\n"
+			".scan:\n"
+			"lea rsi, [rel bb_in_buf]\n"
+			"add rsi, rax\n"
+			"mov rcx, [rel bb_in_end]\n"
+			"sub rcx, rax\n"
+			"mov rdi, rsi\n"
+			"xor eax, eax\n"
+			"repne scasb\n"
+			"jne .all\n"
+			"mov rdx, rdi\n"
+			"sub rdx, rsi\n"
+			"add [rel bb_in_pos], rdx\n"
+			"test ebx, ebx\n"
+			"jz .last\n"
+			"dec rdx\n"
+			".last:\n"
+			"call bb_write\n"
+			"jmp .done\n"
+			".all:\n"
+			"mov rdx, rdi\n"
+			"sub rdx, rsi\n"
+			"add [rel bb_in_pos], rdx\n"
+			"call bb_write\n"
+			"jmp .next\n"
+			".eof:\n"
+			"test ebx, ebx\n"
+			"jnz .done\n"
+			"mov byte [rel tmp], 0\n"
+			"lea rsi, [rel tmp]\n"
+			"mov edx, 1\n"
+			"call bb_write\n"
+			".done:\n"
+			"pop rbx\n"
+			".skip:\n"
+			"ret\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"\n"
+			"section .bss\n"
+			"bb_in_buf resb " BF_IO_BUFFER_SIZE_STR "\n"
+			"bb_in_pos resq 1\n"
+			"bb_in_end resq 1\n"
+			"\n"
+			"section .text\n"
+			"bb_fill:\n"
+			"push rbp\n"
+			"mov rbp, rsp\n"
+			"and rsp, -16\n"
+			"mov rax, [rel stdout wrt ..gotpcrel]\n"
+			"mov rdi, [rax]\n"
+			"call fflush wrt ..plt\n"
+			"xor edi, edi\n"
+			"lea rsi, [rel bb_in_buf]\n"
+			"mov edx, " BF_IO_BUFFER_SIZE_STR "\n"
+			"call read wrt ..plt\n"
+			"test rax, rax\n"
+			"jg .ok\n"
+			"xor eax, eax\n"
+			".ok:\n"
+			"mov [rel bb_in_end], rax\n"
+			"mov qword [rel bb_in_pos], 0\n"
+			"leave\n"
+			"ret\n"
+			"\n"
+			"bb_read:\n"
+			"mov rax, [rel bb_in_pos]\n"
+			"cmp rax, [rel bb_in_end]\n"
+			"jb .ready\n"
+			"call bb_fill\n"
+			"test rax, rax\n"
+			"jz .eof\n"
+			"xor eax, eax\n"
+			".ready:\n"
+			"lea rcx, [rel bb_in_buf]\n"
+			"movzx ecx, byte [rcx + rax]\n"
+			"inc rax\n"
+			"mov [rel bb_in_pos], rax\n"
+			"mov eax, ecx\n"
+			"ret\n"
+			".eof:\n"
+			"xor eax, eax\n"
+			"ret\n"
+			"\n"
+			"bb_echo:\n"
+			"test dil, dil\n"
+			"jz .skip\n"
+			"push rbp\n"
+			"mov rbp, rsp\n"
+			"push rbx\n"
+			"push r13\n"
+			"mov ebx, esi\n"
+			"test ebx, ebx\n"
+			"jz .next\n"
+			"movzx edi, dil\n"
+			"call putchar wrt ..plt\n"
+			".next:\n"
+			"mov rax, [rel bb_in_pos]\n"
+			"cmp rax, [rel bb_in_end]\n"
+			"jb .scan\n"
+			"call bb_fill\n"
+			"test rax, rax\n"
+			"jz .eof\n"
+			"xor eax, eax\n"
+			".scan:\n"
+			"lea r13, [rel bb_in_buf]\n"
+			"add r13, rax\n"
+			"mov rdx, [rel bb_in_end]\n"
+			"sub rdx, rax\n"
+			"mov rdi, r13\n"
+			"xor esi, esi\n"
+			"call memchr wrt ..plt\n"
+			"test rax, rax\n"
+			"jz .all\n"
+			"sub rax, r13\n"
+			"lea rcx, [rax + 1]\n"
+			"add [rel bb_in_pos], rcx\n"
+			"test ebx, ebx\n"
+			"cmovz rax, rcx\n"
+			"mov rdx, rax\n"
+			"mov rdi, r13\n"
+			"mov esi, 1\n"
+			"mov rax, [rel stdout wrt ..gotpcrel]\n"
+			"mov rcx, [rax]\n"
+			"call fwrite wrt ..plt\n"
+			"jmp .done\n"
+			".all:\n"
+			"mov rdx, [rel bb_in_end]\n"
+			"sub rdx, [rel bb_in_pos]\n"
+			"mov rax, [rel bb_in_end]\n"
+			"mov [rel bb_in_pos], rax\n"
+			"mov rdi, r13\n"
+			"mov esi, 1\n"
+			"mov rax, [rel stdout wrt ..gotpcrel]\n"
+			"mov rcx, [rax]\n"
+			"call fwrite wrt ..plt\n"
+			"jmp .next\n"
+			".eof:\n"
+			"test ebx, ebx\n"
+			"jnz .done\n"
+			"xor edi, edi\n"
+			"call putchar wrt ..plt\n"
+			".done:\n"
+			"pop r13\n"
+			"pop rbx\n"
+			"leave\n"
+			".skip:\n"
+			"ret\n"
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+// Writes rdx bytes at rsi to stdout through stdio,
+// the linux target calls bb_write for the same.
+static int emit_out_runtime(FILE* file, Target target)
+{
+	if (target != TARGET_NASM_LIBC) return 1;
+	if (fprintf(
+		file,
+		"\n"
+		"bb_out:\n"
+		"push rbp\n"
+		"mov rbp, rsp\n"
+		"and rsp, -16\n"
+		"mov rdi, rsi\n"
+		"mov esi, 1\n"
+		"mov rax, [rel stdout wrt ..gotpcrel]\n"
+		"mov rcx, [rax]\n"
+		"call fwrite wrt ..plt\n"
+		"leave\n"
+		"ret\n"
+	) < 0) return 0;
+	return 1;
+}
+
+// Stream maps, rdi is the table and esi is the cell.
+// bb_map1 takes a table of 256 output bytes, bb_mapn takes 256 dwords of
+// offset | (length << 24) followed by the output bytes.
+// Output goes through bb_out_buf, which is flushed before blocking on input.
+static int emit_map_runtime(FILE* file, Target target)
+{
+	const char* out = (target == TARGET_NASM_LIBC) ? "bb_out" : "bb_write";
+	if (fprintf(
+		file,
+		"\n"
+		"section .bss\n"
+		"bb_out_buf resb " BF_IO_BUFFER_SIZE_STR " + 1\n"
+		"\n"
+		"section .rodata\n"
+		"align 16\n"
+		"bb_low_nibbles:\n"
+		"db 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15, 15\n"
+		"bb_ones:\n"
+		"db 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1\n"
+		"\n"
+		"section .text\n"
+		"bb_map1:\n"
+		"push rbx\n"
+		"push r13\n"
+		"push r14\n"
+		"push r15\n"
+		"mov r15, rdi\n"
+		"xor r14d, r14d\n"
+		"movzx r13d, sil\n"
+		"test r13d, r13d\n"
+		"jz .done\n"
+		"mov al, [r15 + r13]\n"
+		"mov [rel bb_out_buf], al\n"
+		"inc r14\n"
+		"mov eax, 1\n"
+		"cpuid\n"
+		"and ecx, 1 << 9\n"
+		"mov r13d, ecx\n"
+		".next:\n"
+		"mov rax, [rel bb_in_pos]\n"
+		"cmp rax, [rel bb_in_end]\n"
+		"jb .chunk\n"
+		"lea rsi, [rel bb_out_buf]\n"
+		"mov rdx, r14\n"
+		"call %s\n"
+		"xor r14d, r14d\n"
+		"call bb_fill\n"
+		"test rax, rax\n"
+		"jz .done\n"
+		"xor eax, eax\n"
+		".chunk:\n"
+		"lea rsi, [rel bb_in_buf]\n"
+		"mov rdx, [rel bb_in_end]\n"
+		"lea rdi, [rel bb_out_buf]\n"
+		"test r13d, r13d\n"
+		"jz .byte\n"
+		"movdqa xmm6, [rel bb_ones]\n"
+		"movdqa xmm7, [rel bb_low_nibbles]\n"
+		".vector:\n"
+		"lea rcx, [rax + 16]\n"
+		"cmp rcx, rdx\n"
+		"ja .byte\n"
+		"movdqu xmm0, [rsi + rax]\n"
+		"pxor xmm1, xmm1\n"
+		"pcmpeqb xmm1, xmm0\n"
+		"pmovmskb ecx, xmm1\n"
+		"test ecx, ecx\n"
+		"jnz .byte\n"
+		"movdqa xmm2, xmm0\n"
+		"pand xmm2, xmm7\n"
+		"movdqa xmm3, xmm0\n"
+		"psrlw xmm3, 4\n"
+		"pand xmm3, xmm7\n"
+		"pxor xmm4, xmm4\n"
+		"pxor xmm5, xmm5\n",
+		out
+	) < 0) return 0;
+	// Every 16 byte row of the table is looked up by the low nibble
+	// and kept for the bytes whose high nibble selects that row.
+	for (size_t row = 0; row < 16; row++)
+	{
+		if (fprintf(
+			file,
+			"movdqa xmm1, xmm3\n"
+			"pcmpeqb xmm1, xmm5\n"
+			"movdqu xmm8, [r15 + %zu]\n"
+			"pshufb xmm8, xmm2\n"
+			"pand xmm8, xmm1\n"
+			"por xmm4, xmm8\n"
+			"paddb xmm5, xmm6\n",
+			row * 16
+		) < 0) return 0;
+	}
+	if (fprintf(
+		file,
+		"movdqu [rdi + r14], xmm4\n"
+		"add rax, 16\n"
+		"add r14, 16\n"
+		"jmp .vector\n"
+		".byte:\n"
+		"cmp rax, rdx\n"
+		"jae .consumed\n"
+		"movzx ecx, byte [rsi + rax]\n"
+		"inc rax\n"
+		"test ecx, ecx\n"
+		"jz .stop\n"
+		"mov cl, [r15 + rcx]\n"
+		"mov [rdi + r14], cl\n"
+		"inc r14\n"
+		"jmp .byte\n"
+		".consumed:\n"
+		"mov [rel bb_in_pos], rax\n"
+		"jmp .next\n"
+		".stop:\n"
+		"mov [rel bb_in_pos], rax\n"
+		"lea rsi, [rel bb_out_buf]\n"
+		"mov rdx, r14\n"
+		"call %s\n"
+		".done:\n"
+		"pop r15\n"
+		"pop r14\n"
+		"pop r13\n"
+		"pop rbx\n"
+		"ret\n"
+		"\n"
+		"bb_mapn:\n"
+		"push r14\n"
+		"push r15\n"
+		"mov r15, rdi\n"
+		"xor r14d, r14d\n"
+		"movzx ecx, sil\n"
+		"test ecx, ecx\n"
+		"jz .done\n"
+		"jmp .emit\n"
+		".next:\n"
+		"mov rax, [rel bb_in_pos]\n"
+		"cmp rax, [rel bb_in_end]\n"
+		"jb .byte\n"
+		"lea rsi, [rel bb_out_buf]\n"
+		"mov rdx, r14\n"
+		"call %s\n"
+		"xor r14d, r14d\n"
+		"call bb_fill\n"
+		"test rax, rax\n"
+		"jz .done\n"
+		"xor eax, eax\n"
+		".byte:\n"
+		"lea rsi, [rel bb_in_buf]\n"
+		"movzx ecx, byte [rsi + rax]\n"
+		"inc rax\n"
+		"mov [rel bb_in_pos], rax\n"
+		"test ecx, ecx\n"
+		"jz .stop\n"
+		".emit:\n"
+		"mov eax, [r15 + rcx * 4]\n"
+		"mov ecx, eax\n"
+		"shr ecx, 24\n"
+		"and eax, 0xFFFFFF\n"
+		"lea rsi, [r15 + rax + 1024]\n"
+		"lea rdi, [rel bb_out_buf]\n"
+		"add rdi, r14\n"
+		"add r14, rcx\n"
+		"rep movsb\n"
+		"cmp r14, " BF_IO_BUFFER_SIZE_STR " - 255\n"
+		"jb .next\n"
+		"lea rsi, [rel bb_out_buf]\n"
+		"mov rdx, r14\n"
+		"call %s\n"
+		"xor r14d, r14d\n"
+		"jmp .next\n"
+		".stop:\n"
+		"lea rsi, [rel bb_out_buf]\n"
+		"mov rdx, r14\n"
+		"call %s\n"
+		".done:\n"
+		"pop r15\n"
+		"pop r14\n"
+		"ret\n",
+		out, out, out, out
+	) < 0) return 0;
+	return 1;
+}
+
+// Helpers of TARGET_NASM_EMBED, they find the frame at r15 and align the
+// stack themselves before calling io. A failed write returns from the
+// emitted function through bb_exit, which restores rsp from r15.
+static int emit_embed_runtime(FILE* file)
+{
+	if (fprintf(
+		file,
+		"\n"
+		"bb_flush:\n"
+		"mov rdx, [r15 + %d]\n"
+		"test rdx, rdx\n"
+		"jz .done\n"
+		"push rbp\n"
+		"mov rbp, rsp\n"
+		"and rsp, -16\n"
+		"mov rax, [r15 + %d]\n"
+		"mov rdi, [rax + %d]\n"
+		"lea rsi, [r15 + %d]\n"
+		"call qword [rax + %d]\n"
+		"leave\n"
+		"mov qword [r15 + %d], 0\n"
+		"test eax, eax\n"
+		"jnz .fail\n"
+		".done:\n"
+		"ret\n"
+		".fail:\n"
+		"mov eax, %d\n"
+		"jmp bb_exit\n"
+		"\n"
+		"bb_fill:\n"
+		"call bb_flush\n"
+		"push rbp\n"
+		"mov rbp, rsp\n"
+		"and rsp, -16\n"
+		"mov rax, [r15 + %d]\n"
+		"mov rdi, [rax + %d]\n"
+		"lea rsi, [r15 + %d]\n"
+		"mov edx, %d\n"
+		"call qword [rax + %d]\n"
+		"leave\n"
+		"mov ecx, %d\n"
+		"cmp rax, rcx\n"
+		"cmova rax, rcx\n"
+		"mov [r15 + %d], rax\n"
+		"mov qword [r15 + %d], 0\n"
+		"ret\n",
+		EMBED_OUT_LEN,
+		EMBED_IO,
+		EMBED_IO_CONTEXT,
+		EMBED_OUT_BUF,
+		EMBED_IO_WRITE,
+		EMBED_OUT_LEN,
+		EMBED_ERROR_WRITE,
+		EMBED_IO,
+		EMBED_IO_CONTEXT,
+		EMBED_IN_BUF,
+		EMBED_BUF_SIZE,
+		EMBED_IO_READ,
+		EMBED_BUF_SIZE,
+		EMBED_IN_END,
+		EMBED_IN_POS
+	) < 0) return 0;
+	if (fprintf(
+		file,
+		"\n"
+		"bb_read:\n"
+		"mov rax, [r15 + %d]\n"
+		"cmp rax, [r15 + %d]\n"
+		"jb .ready\n"
+		"call bb_fill\n"
+		"test rax, rax\n"
+		"jz .eof\n"
+		"xor eax, eax\n"
+		".ready:\n"
+		"movzx ecx, byte [r15 + rax + %d]\n"
+		"inc rax\n"
+		"mov [r15 + %d], rax\n"
+		"mov eax, ecx\n"
+		"ret\n"
+		".eof:\n"
+		"xor eax, eax\n"
+		"ret\n"
+		"\n"
+		"bb_write:\n"
+		"mov rax, [r15 + %d]\n"
+		"mov [r15 + rax + %d], dil\n"
+		"inc rax\n"
+		"mov [r15 + %d], rax\n"
+		"cmp rax, %d\n"
+		"jae bb_flush\n"
+		"ret\n"
+		"\n"
+		"bb_reserve:\n"
+		"mov rax, [r15 + %d]\n"
+		"add rax, rdx\n"
+		"cmp rax, %d\n"
+		"jbe .ready\n"
+		"push rdx\n"
+		"call bb_flush\n"
+		"pop rdx\n"
+		".ready:\n"
+		"mov rax, [r15 + %d]\n"
+		"lea rdi, [r15 + rax + %d]\n"
+		"add rax, rdx\n"
+		"mov [r15 + %d], rax\n"
+		"ret\n"
+		"\n"
+		"bb_echo:\n"
+		"push rbx\n"
+		"push r14\n"
+		"movzx ebx, dil\n"
+		"mov r14d, esi\n"
+		".next:\n"
+		"test ebx, ebx\n"
+		"jz .done\n"
+		"test r14d, r14d\n"
+		"jz .read\n"
+		"mov edi, ebx\n"
+		"call bb_write\n"
+		".read:\n"
+		"call bb_read\n"
+		"mov ebx, eax\n"
+		"test r14d, r14d\n"
+		"jnz .next\n"
+		"mov edi, ebx\n"
+		"call bb_write\n"
+		"jmp .next\n"
+		".done:\n"
+		"pop r14\n"
+		"pop rbx\n"
+		"ret\n",
+		EMBED_IN_POS,
+		EMBED_IN_END,
+		EMBED_IN_BUF,
+		EMBED_IN_POS,
+		EMBED_OUT_LEN,
+		EMBED_OUT_BUF,
+		EMBED_OUT_LEN,
+		EMBED_BUF_SIZE,
+		EMBED_OUT_LEN,
+		EMBED_BUF_SIZE,
+		EMBED_OUT_LEN,
+		EMBED_OUT_BUF,
+		EMBED_OUT_LEN
+	) < 0) return 0;
+	return 1;
+}
+
+static int emit_file_tail(FILE* file, Target target, uint32_t used_ops)
+{
+	switch (target)
+	{
+	case TARGET_BF: break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"mov eax, 1\n"
+			"mov ebx, 0\n"
 			"int 80h\n"
 		) < 0) return 0;
 	} break;
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"mov rdi, 0\n"
+			"call exit wrt ..plt\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"call bb_flush\n"
+			"mov eax, %d\n"
+			"bb_exit:\n"
+			"lea rsp, [r15 + %d]\n"
+			"pop r15\n"
+			"pop r14\n"
+			"pop r13\n"
+			"pop r12\n"
+			"pop rbx\n"
+			"pop rbp\n"
+			"ret\n",
+			EMBED_OK,
+			EMBED_FRAME_SIZE
+		) < 0) return 0;
+		if (!emit_embed_runtime(file)) return 0;
+		// Without the note, linkers make the stack of the host executable.
+		if (fprintf(file, "\nsection .note.GNU-stack noalloc noexec nowrite progbits\n") < 0) return 0;
+		return 1;
+	} break;
 	default: {
 		ASSERT(0);
 	} break;
 	}
+	if (target == TARGET_BF) return 1;
+	if (!emit_runtime(file, target)) return 0;
+	uint32_t buffered = ((uint32_t)1 << OP_TAG_MAP) | ((uint32_t)1 << OP_TAG_PRINT);
+	if ((used_ops & buffered) && !emit_out_runtime(file, target)) return 0;
+	if ((used_ops & ((uint32_t)1 << OP_TAG_MAP)) && !emit_map_runtime(file, target)) return 0;
+	if ((used_ops & ((uint32_t)1 << OP_TAG_PRINT)) && fprintf(
+		file,
+		"\n"
+		"section .bss\n"
+		"alignb 16\n"
+		"bb_print_buf resb %d\n"
+		"section .text\n",
+		PRINT_MAX_COUNT
+	) < 0) return 0;
 	return 1;
 }
 
-static int emit_code(Block* block, FILE* file, Target target)
+// Sets the flags by comparing the cell to 0.
+static int emit_cell_test(FILE* file, Target target)
 {
-	size_t layer = 0;
-	Blocks loops = {0};
-	if (!emit_file_head(file, target)) goto error;
-	while (1)
+	if (target == TARGET_NASM_EMBED) return fprintf(file, "cmp byte [r13 + r12], 0\n") >= 0;
+	return fprintf(file, "lea rax, [rel mem]\ncmp byte [rax + r12], 0\n") >= 0;
+}
+
+// A top level range of the program whose code is emitted on its own.
+// Labels are `<kind>_<region>_<number>`, numbered in emission order within
+// the region, so the text of a region only depends on the region.
+typedef struct EmitRegion EmitRegion;
+struct EmitRegion
+{
+	size_t index;
+	uint32_t labels; // Labels numbered so far.
+	// Section of the code, which ops that emit data return to.
+	const char* text_section;
+	Block* start;
+	Block* stop; // Start of the next region, or NULL.
+	Blocks cold;
+	char* text; // Buffered code, if the region is emitted on a thread.
+	size_t text_size;
+	char* cold_text;
+	size_t cold_text_size;
+	int ok;
+};
+
+#define LABEL "%zu_%" PRIu32
+
+static int emit_loop_exit_check(Block* loop, EmitRegion* region, FILE* file, Target target)
+{
+	if (!emit_cell_test(file, target)) return 0;
+	if (fprintf(file, "je .end_" LABEL "\n", region->index, loop->label) < 0) return 0;
+	return 1;
+}
+
+static int emit_loop_head(Block* loop, EmitRegion* region, size_t layer, FILE* file, Target target)
+{
+	switch (target)
 	{
-		if (block->exit != NULL)
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		if (fprintf(file, "[\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: case TARGET_NASM_EMBED: {
+		if (loop->heat == BLOCK_HEAT_HOT && fprintf(file, "align 16\n") < 0) return 0;
+		if (fprintf(file, ".loop_" LABEL ":\n", region->index, loop->label) < 0) return 0;
+		if (!emit_loop_exit_check(loop, region, file, target)) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int emit_loop_tail(Block* loop, EmitRegion* region, size_t layer, FILE* file, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer - 1, file)) return 0;
+		if (fprintf(file, "]\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"jmp .loop_" LABEL "\n"
+			".end_" LABEL ":\n",
+			region->index,
+			loop->label,
+			region->index,
+			loop->label
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int inc_signed_count(OpInc inc)
+{
+	int32_t count = inc.value;
+	if (count > INT8_MAX) count = -((int32_t)UINT8_MAX - count + 1);
+	return (int)count;
+}
+
+static int emit_op_inc(OpInc inc, size_t layer, FILE* file, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		int count = inc_signed_count(inc);
+		for (int i = count; i > 0; i--)
+		{
+			if (fprintf(file, "+") < 0) return 0;
+		}
+		for (int i = -count; i > 0; i--)
+		{
+			if (fprintf(file, "-") < 0) return 0;
+		}
+		if (fprintf(file, "\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"lea rbx, [rel mem]\n"
+			"mov al, [rbx + r12]\n"
+			"add al, %" PRIu8 "\n"
+			"mov [rbx + r12], al\n",
+			inc.value
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		if (fprintf(file, "add byte [r13 + r12], %" PRIu8 "\n", inc.value) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+
+static int shift_signed_count(OpShift shift)
+{
+	int32_t count = shift.index;
+	if (count > BF_MEMORY_SIZE / 2) count = -((int32_t)BF_MEMORY_SIZE - count);
+	return (int)count;
+}
+
+static int emit_op_shift(OpShift shift, size_t layer, FILE* file, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		int count = shift_signed_count(shift);
+		for (int i = count; i > 0; i--)
+		{
+			if (fprintf(file, ">") < 0) return 0;
+		}
+		for (int i = -count; i > 0; i--)
+		{
+			if (fprintf(file, "<") < 0) return 0;
+		}
+		if (fprintf(file, "\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"add r12w, %" PRIu16 "\n"
+			"xor dx, dx\n"
+			"mov ax, r12w\n"
+			"mov bx, " BF_MEMORY_SIZE_STR  "\n"
+			"div bx\n"
+			"mov r12w, dx\n",
+			shift.index
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int emit_op_read(FILE* file, size_t layer, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		if (fprintf(file, ",\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"call bb_read\n"
+			"lea rbx, [rel mem]\n"
+			"mov [rbx + r12], al\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"call bb_read\n"
+			"mov [mem + r12], al\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"call bb_read\n"
+			"mov [r13 + r12], al\n"
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int emit_op_write(FILE* file, size_t layer, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		if (fprintf(file, ".\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"xor rdi, rdi\n"
+			"lea rbx, [rel mem]\n"
+			"mov dil, [rbx + r12]\n"
+			"call putchar wrt ..plt\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"xor eax, eax\n"
+			"mov al, [mem + r12]\n"
+			"mov [tmp], eax\n"
+			"mov eax, 0x4\n"
+			"mov ebx, 0x1\n"
+			"mov ecx, tmp\n"
+			"mov edx, 0x1\n"
+			"int 80h\n"
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"movzx edi, byte [r13 + r12]\n"
+			"call bb_write\n"
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int emit_op_echo(OpEcho echo, size_t layer, FILE* file, Target target)
+{
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!print_tab(layer, file)) return 0;
+		if (fprintf(file, echo.write_first ? "[.,]\n" : "[,.]\n") < 0) return 0;
+	} break;
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"lea rbx, [rel mem]\n"
+			"movzx edi, byte [rbx + r12]\n"
+			"mov esi, %" PRIu8 "\n"
+			"call bb_echo\n"
+			"mov byte [rbx + r12], 0\n",
+			echo.write_first
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"movzx edi, byte [mem + r12]\n"
+			"mov esi, %" PRIu8 "\n"
+			"call bb_echo\n"
+			"mov byte [mem + r12], 0\n",
+			echo.write_first
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		if (fprintf(
+			file,
+			"movzx edi, byte [r13 + r12]\n"
+			"mov esi, %" PRIu8 "\n"
+			"call bb_echo\n"
+			"mov byte [r13 + r12], 0\n",
+			echo.write_first
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+// Profiles start with PROFILE_MAGIC and a 64 bit record count,
+// followed by a ProfileRecord for every block in emission order.
+#define PROFILE_MAGIC "BBPROF2"
+#define PROFILE_HEADER_SIZE 16
+#define PROFILE_DEFAULT_PATH "bb.prof"
+#define PROFILE_KIND_BLOCK 0
+#define PROFILE_KIND_LOOP 1
+// Loops run at least PGO_HOT_MIN times and within PGO_HOT_FRACTION of the
+// hottest loop are aligned and unrolled PGO_UNROLL times if they have no
+// nested loops. Loops that never ran are moved out of line.
+#define PGO_HOT_MIN 1024
+#define PGO_HOT_FRACTION 16
+#define PGO_UNROLL 4
+
+typedef struct ProfileRecord ProfileRecord;
+struct ProfileRecord
+{
+	uint32_t line;
+	uint32_t column;
+	uint32_t kind;
+	uint32_t reserved;
+	uint64_t hash;
+	uint64_t count;
+};
+
+static int emit_profile_counter(size_t index, FILE* file)
+{
+	if (fprintf(
+		file,
+		"inc qword [rel bb_profile + %zu]\n",
+		PROFILE_HEADER_SIZE + index * sizeof(ProfileRecord) + offsetof(ProfileRecord, count)
+	) < 0) return 0;
+	return 1;
+}
+
+static int emit_profile_dump(Blocks* profiled, const char* path, FILE* file, Target target)
+{
+	switch (target)
+	{
+	case TARGET_NASM_LIBC: {
+		if (fprintf(
+			file,
+			"extern fopen\n"
+			"extern fclose\n"
+			"lea rdi, [rel bb_profile_path]\n"
+			"lea rsi, [rel bb_profile_mode]\n"
+			"call fopen wrt ..plt\n"
+			"test rax, rax\n"
+			"jz .profile_done\n"
+			"mov rbx, rax\n"
+			"lea rdi, [rel bb_profile]\n"
+			"mov esi, 1\n"
+			"mov edx, %zu\n"
+			"mov rcx, rbx\n"
+			"call fwrite wrt ..plt\n"
+			"mov rdi, rbx\n"
+			"call fclose wrt ..plt\n"
+			".profile_done:\n",
+			PROFILE_HEADER_SIZE + profiled->count * sizeof(ProfileRecord)
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_LINUX: {
+		if (fprintf(
+			file,
+			"mov eax, 2\n"
+			"lea rdi, [rel bb_profile_path]\n"
+			"mov esi, 0x241\n"
+			"mov edx, 420\n"
+			"syscall\n"
+			"test rax, rax\n"
+			"js .profile_done\n"
+			"mov rbx, rax\n"
+			"mov eax, 1\n"
+			"mov rdi, rbx\n"
+			"lea rsi, [rel bb_profile]\n"
+			"mov edx, %zu\n"
+			"syscall\n"
+			"mov eax, 3\n"
+			"mov rdi, rbx\n"
+			"syscall\n"
+			".profile_done:\n",
+			PROFILE_HEADER_SIZE + profiled->count * sizeof(ProfileRecord)
+		) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+
+	if (fprintf(
+		file,
+		"section .data\n"
+		"align 8\n"
+		"bb_profile:\n"
+		"db \"" PROFILE_MAGIC "\", 0\n"
+		"dq %zu\n",
+		profiled->count
+	) < 0) return 0;
+	for (size_t i = 0; i < profiled->count; i++)
+	{
+		Block* block = profiled->items[i];
+		if (fprintf(
+			file,
+			"dd %" PRIu32 ", %" PRIu32 ", %d, 0\n"
+			"dq %" PRIu64 ", 0\n",
+			block->line,
+			block->column,
+			(block->exit != NULL) ? PROFILE_KIND_LOOP : PROFILE_KIND_BLOCK,
+			block->hash
+		) < 0) return 0;
+	}
+	if (fprintf(file, "bb_profile_mode:\ndb \"wb\", 0\nbb_profile_path:\ndb ") < 0) return 0;
+	for (const char* c = path; *c != '\0'; c++)
+	{
+		if (fprintf(file, "%d, ", (unsigned char)*c) < 0) return 0;
+	}
+	if (fprintf(file, "0\nsection .text\n") < 0) return 0;
+	return 1;
+}
+
+static int emit_blocks(
+	Block* block,
+	Block* stop,
+	size_t layer,
+	FILE* file,
+	Target target,
+	EmitRegion* region,
+	Blocks* profiled,
+	Blocks* cold,
+	const char* source_path);
+
+// Returns the set of tags of all ops in the program, as bits of (1 << tag).
+static uint32_t blocks_used_ops(Block* block)
+{
+	Blocks loops = {0};
+	uint32_t used = 0;
+	while (1)
+	{
+		if (block->exit != NULL) blocks_push(&loops, block);
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			used |= (uint32_t)1 << block->ops.items[i].tag;
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			block = blocks_pop(&loops)->exit;
+		}
+		else block = block->next;
+	}
+	free(loops.items);
+	return used;
+}
+
+static int emit_op_print(OpPrint op, EmitRegion* region, size_t layer, FILE* file, Target target)
+{
+	PrintRun* run = op.run;
+	uint32_t label = (target == TARGET_BF) ? 0 : region->labels++;
+	switch (target)
+	{
+	case TARGET_BF: {
+		uint8_t value = 0;
+		for (size_t i = 0; i < run->count; i++)
+		{
+			OpInc inc = { .value = (uint8_t)(run->deltas[i] - value) };
+			if (inc.value != 0 && !emit_op_inc(inc, layer, file, target)) return 0;
+			if (!emit_op_write(file, layer, target)) return 0;
+			value = run->deltas[i];
+		}
+		OpInc inc = { .value = (uint8_t)(run->inc - value) };
+		if (inc.value != 0 && !emit_op_inc(inc, layer, file, target)) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
+		// The deltas are padded to whole 16 byte vectors.
+		size_t padded = (run->count + 15) / 16 * 16;
+		if (fprintf(file, "section .rodata\nalign 16\n..@print_" LABEL ":\n", region->index, label) < 0) return 0;
+		for (size_t i = 0; i < padded; i++)
+		{
+			uint8_t delta = (i < run->count) ? run->deltas[i] : 0;
+			if (fprintf(file, (i % 16 == 0) ? "db %" PRIu8 : ", %" PRIu8, delta) < 0) return 0;
+			if (i % 16 == 15 && fprintf(file, "\n") < 0) return 0;
+		}
+		if (fprintf(
+			file,
+			"section %s\n"
+			"%s\n"
+			"imul eax, eax, 0x01010101\n"
+			"movd xmm0, eax\n"
+			"pshufd xmm0, xmm0, 0\n",
+			region->text_section,
+			(target == TARGET_NASM_LIBC)
+				? "lea rbx, [rel mem]\nmovzx eax, byte [rbx + r12]"
+				: "movzx eax, byte [mem + r12]"
+		) < 0) return 0;
+		for (size_t i = 0; i < padded; i += 16)
+		{
+			if (fprintf(
+				file,
+				"movdqa xmm1, [rel ..@print_" LABEL " + %zu]\n"
+				"paddb xmm1, xmm0\n"
+				"movdqa [rel bb_print_buf + %zu], xmm1\n",
+				region->index,
+				label,
+				i,
+				i
+			) < 0) return 0;
+		}
+		if (fprintf(
+			file,
+			"lea rsi, [rel bb_print_buf]\n"
+			"mov edx, %zu\n"
+			"call %s\n",
+			run->count,
+			(target == TARGET_NASM_LIBC) ? "bb_out" : "bb_write"
+		) < 0) return 0;
+		if (run->inc != 0 && fprintf(
+			file,
+			(target == TARGET_NASM_LIBC)
+				? "lea rbx, [rel mem]\nadd byte [rbx + r12], %" PRIu8 "\n"
+				: "add byte [mem + r12], %" PRIu8 "\n",
+			run->inc
+		) < 0) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		// The bytes are added straight into the output buffer.
+		size_t padded = (run->count + 15) / 16 * 16;
+		if (fprintf(file, "section .rodata\nalign 16\n..@print_" LABEL ":\n", region->index, label) < 0) return 0;
+		for (size_t i = 0; i < padded; i++)
+		{
+			uint8_t delta = (i < run->count) ? run->deltas[i] : 0;
+			if (fprintf(file, (i % 16 == 0) ? "db %" PRIu8 : ", %" PRIu8, delta) < 0) return 0;
+			if (i % 16 == 15 && fprintf(file, "\n") < 0) return 0;
+		}
+		if (fprintf(
+			file,
+			"section %s\n"
+			"mov edx, %zu\n"
+			"call bb_reserve\n"
+			"movzx eax, byte [r13 + r12]\n"
+			"imul eax, eax, 0x01010101\n"
+			"movd xmm0, eax\n"
+			"pshufd xmm0, xmm0, 0\n",
+			region->text_section,
+			run->count
+		) < 0) return 0;
+		for (size_t i = 0; i < padded; i += 16)
+		{
+			if (fprintf(
+				file,
+				"movdqa xmm1, [rel ..@print_" LABEL " + %zu]\n"
+				"paddb xmm1, xmm0\n"
+				"movdqu [rdi + %zu], xmm1\n",
+				region->index,
+				label,
+				i,
+				i
+			) < 0) return 0;
+		}
+		if (run->inc != 0 && fprintf(file, "add byte [r13 + r12], %" PRIu8 "\n", run->inc) < 0) return 0;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+static int emit_op_map(OpMap op, EmitRegion* region, size_t layer, FILE* file, Target target)
+{
+	StreamMap* map = op.map;
+	int one_to_one = 1;
+	for (size_t i = 1; i <= UINT8_MAX; i++)
+	{
+		if (map->lengths[i] != 1) one_to_one = 0;
+	}
+	switch (target)
+	{
+	case TARGET_BF: {
+		if (!emit_blocks(map->loop, NULL, layer, file, target, region, NULL, NULL, NULL)) return 0;
+	} break;
+	case TARGET_NASM_EMBED: {
+		// The table driven runtime keeps its buffers in globals,
+		// so the original loop is emitted instead.
+		if (!emit_blocks(map->loop, NULL, layer, file, target, region, NULL, NULL, NULL)) return 0;
+	} break;
+	case TARGET_NASM_LIBC: case TARGET_NASM_LINUX: {
+		uint32_t label = region->labels++;
+		if (fprintf(file, "section .rodata\n..@map_" LABEL ":\n", region->index, label) < 0) return 0;
+		for (size_t i = 0; i <= UINT8_MAX; i++)
+		{
+			// One to one maps are a plain table, others are offset and
+			// length pairs followed by the output bytes.
+			if (one_to_one)
+			{
+				uint8_t byte = (i == 0) ? 0 : map->bytes[map->offsets[i]];
+				if (fprintf(file, (i % 16 == 0) ? "db %" PRIu8 : ", %" PRIu8, byte) < 0) return 0;
+			}
+			else
+			{
+				uint32_t entry = map->offsets[i] | ((uint32_t)map->lengths[i] << 24);
+				if (fprintf(file, (i % 16 == 0) ? "dd %" PRIu32 : ", %" PRIu32, entry) < 0) return 0;
+			}
+			if (i % 16 == 15 && fprintf(file, "\n") < 0) return 0;
+		}
+		for (size_t i = 0; !one_to_one && i < map->size; i++)
+		{
+			if (fprintf(file, (i % 16 == 0) ? "db %" PRIu8 : ", %" PRIu8, map->bytes[i]) < 0) return 0;
+			if ((i % 16 == 15 || i + 1 == map->size) && fprintf(file, "\n") < 0) return 0;
+		}
+		if (fprintf(
+			file,
+			"section %s\n"
+			"lea rdi, [rel ..@map_" LABEL "]\n",
+			region->text_section,
+			region->index,
+			label
+		) < 0) return 0;
+		if (target == TARGET_NASM_LIBC)
+		{
+			if (fprintf(
+				file,
+				"lea rbx, [rel mem]\n"
+				"movzx esi, byte [rbx + r12]\n"
+				"call %s\n"
+				"mov byte [rbx + r12], 0\n",
+				one_to_one ? "bb_map1" : "bb_mapn"
+			) < 0) return 0;
+		}
+		else
+		{
+			if (fprintf(
+				file,
+				"movzx esi, byte [mem + r12]\n"
+				"call %s\n"
+				"mov byte [mem + r12], 0\n",
+				one_to_one ? "bb_map1" : "bb_mapn"
+			) < 0) return 0;
+		}
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+	return 1;
+}
+
+// Lowered ops have labels of their own, so only loops of these are unrolled.
+static int loop_is_unrollable(Block* loop)
+{
+	if (loop->next != NULL) return 0;
+	for (size_t i = 0; i < loop->ops.count; i++)
+	{
+		switch (loop->ops.items[i].tag)
+		{
+		case OP_TAG_INC: case OP_TAG_SHIFT:
+		case OP_TAG_READ: case OP_TAG_WRITE: break;
+		default: return 0;
+		}
+	}
+	return 1;
+}
+
+// Attributes the following instructions to a line of source_path in debug info.
+static int emit_source_line(uint32_t line, const char* source_path, FILE* file)
+{
+	if (fprintf(file, "%%line %" PRIu32 "+0 %s\n", line, source_path) < 0) return 0;
+	return 1;
+}
+
+static int emit_ops(Block* block, EmitRegion* region, size_t layer, FILE* file, Target target, const char* source_path)
+{
+	for (size_t i = 0; i < block->ops.count; i++)
+	{
+		Op op = block->ops.items[i];
+		if (source_path != NULL && !emit_source_line(op.line, source_path, file)) return 0;
+		switch (op.tag)
+		{
+		case OP_TAG_INC: {
+			if (!emit_op_inc(op.as.inc, layer, file, target)) return 0;
+		} break;
+		case OP_TAG_SHIFT: {
+			if (!emit_op_shift(op.as.shift, layer, file, target)) return 0;
+		} break;
+		case OP_TAG_READ: {
+			if (!emit_op_read(file, layer, target)) return 0;
+		} break;
+		case OP_TAG_WRITE: {
+			if (!emit_op_write(file, layer, target)) return 0;
+		} break;
+		case OP_TAG_ECHO: {
+			if (!emit_op_echo(op.as.echo, layer, file, target)) return 0;
+		} break;
+		case OP_TAG_MAP: {
+			if (!emit_op_map(op.as.map, region, layer, file, target)) return 0;
+		} break;
+		case OP_TAG_PRINT: {
+			if (!emit_op_print(op.as.print, region, layer, file, target)) return 0;
+		} break;
+		default: {
+			ASSERT(0);
+		} break;
+		}
+	}
+	return 1;
+}
+
+// Every emitted block is appended to profiled, unless it is NULL,
+// and counts its executions in the matching profile record.
+// Cold loops are only entered from here and appended to cold, unless it is NULL,
+// to be emitted out of line by emit_cold_loops.
+// Instructions are attributed to their source lines, unless source_path is NULL.
+// Stops before stop, if it is reached outside of the loops started here.
+static int emit_blocks(
+	Block* block,
+	Block* stop,
+	size_t layer,
+	FILE* file,
+	Target target,
+	EmitRegion* region,
+	Blocks* profiled,
+	Blocks* cold,
+	const char* source_path)
+{
+	size_t base_layer = layer;
+	Blocks loops = {0};
+	while (loops.count != 0 || block != stop)
+	{
+		if (block->exit != NULL) block->label = region->labels++;
+		if (block->exit != NULL && source_path != NULL)
+		{
+			if (!emit_source_line(block->line, source_path, file)) goto error;
+		}
+		if (block->exit != NULL && block->heat == BLOCK_HEAT_COLD && cold != NULL)
+		{
+			if (!emit_cell_test(file, target)) goto error;
+			if (fprintf(
+				file,
+				"jne ..@cold_" LABEL "\n"
+				"..@back_" LABEL ":\n",
+				region->index,
+				block->label,
+				region->index,
+				block->label
+			) < 0) goto error;
+			blocks_push(cold, block);
+			block = block->exit;
+			continue;
+		}
+		if (block->exit != NULL)
+		{
+			if (!emit_loop_head(block, region, layer, file, target)) goto error;
+			blocks_push(&loops, block);
+			layer++;
+		}
+		if (profiled != NULL)
+		{
+			if (!emit_profile_counter(profiled->count, file)) goto error;
+			blocks_push(profiled, block);
+		}
+		if (!emit_ops(block, region, layer, file, target, source_path)) goto error;
+		// Counters would only see every PGO_UNROLL-th iteration of unrolled loops.
+		if (block->exit != NULL && block->heat == BLOCK_HEAT_HOT && target != TARGET_BF
+			&& profiled == NULL && loop_is_unrollable(block))
+		{
+			for (int i = 1; i < PGO_UNROLL; i++)
+			{
+				if (!emit_loop_exit_check(block, region, file, target)) goto error;
+				if (!emit_ops(block, region, layer, file, target, source_path)) goto error;
+			}
+		}
+
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			block = blocks_pop(&loops);
+			if (!emit_loop_tail(block, region, layer, file, target)) goto error;
+			block = block->exit;
+			layer--;
+		}
+		else block = block->next;
+	}
+
+	ASSERT(layer == base_layer);
+	free(loops.items);
+	return 1;
+error:
+	free(loops.items);
+	return 0;
+}
+
+// Emits the cold loops of the region, which belong in .text.unlikely.
+static int emit_cold_loops(EmitRegion* region, FILE* file, Target target, Blocks* profiled, const char* source_path)
+{
+	Blocks* cold = &region->cold;
+	region->text_section = ".text.unlikely";
+	// Cold loops nested in cold loops are appended while emitting.
+	for (size_t i = 0; i < cold->count; i++)
+	{
+		Block* loop = cold->items[i];
+		if (fprintf(file, "section %s\n..@cold_" LABEL ":\n", region->text_section, region->index, loop->label) < 0) return 0;
+		if (source_path != NULL && !emit_source_line(loop->line, source_path, file)) return 0;
+		if (!emit_loop_head(loop, region, 0, file, target)) return 0;
+		// Emits the body without coming back to the loop head.
+		Block* exit = loop->exit;
+		loop->exit = NULL;
+		int emitted = emit_blocks(loop, NULL, 1, file, target, region, profiled, cold, source_path);
+		loop->exit = exit;
+		if (!emitted) return 0;
+		if (!emit_loop_tail(loop, region, 1, file, target)) return 0;
+		if (fprintf(file, "jmp ..@back_" LABEL "\n", region->index, loop->label) < 0) return 0;
+	}
+	region->text_section = ".text";
+	return 1;
+}
+
+// Number of ops of the loop nest starting at loop.
+static size_t nest_op_count(Block* loop)
+{
+	Blocks loops = {0};
+	blocks_push(&loops, loop);
+	size_t count = loop->ops.count;
+	Block* block = loop->next;
+	while (1)
+	{
+		if (block == NULL)
+		{
+			Block* done = blocks_pop(&loops);
+			if (done == loop) break;
+			block = done->exit;
+			continue;
+		}
+		count += block->ops.count;
+		if (block->exit != NULL) blocks_push(&loops, block);
+		block = block->next;
+	}
+	free(loops.items);
+	return count;
+}
+
+// Cuts the top level of the program into regions of at least region_ops ops,
+// except for the last one.
+static EmitRegion* find_emit_regions(Block* block, size_t region_ops, size_t* region_count)
+{
+	EmitRegion* regions = NULL;
+	size_t count = 0;
+	size_t ops = 0;
+	while (block != NULL)
+	{
+		if (count == 0 || ops >= region_ops)
+		{
+			regions = realloc(regions, (count + 1) * sizeof(EmitRegion));
+			if (regions == NULL) crash_alloc_failed();
+			if (count != 0) regions[count - 1].stop = block;
+			regions[count] = (EmitRegion){ .index = count, .text_section = ".text", .start = block, .ok = 1 };
+			count++;
+			ops = 0;
+		}
+		if (block->exit == NULL)
+		{
+			ops += block->ops.count;
+			block = block->next;
+		}
+		else
+		{
+			ops += nest_op_count(block);
+			block = block->exit;
+		}
+	}
+	*region_count = count;
+	return regions;
+}
+
+typedef struct Code Code;
+struct Code
+{
+	size_t capacity;
+	size_t count;
+	uint8_t* bytes;
+};
+
+static void code_push(Code* code, const void* bytes, size_t count)
+{
+	if (code->count + count > code->capacity)
+	{
+		ASSERT(code->capacity <= SIZE_MAX / 2 - count);
+		code->capacity = code->capacity * 2 + count;
+		code->bytes = realloc(code->bytes, code->capacity);
+		if (code->bytes == NULL) crash_alloc_failed();
+	}
+	memcpy(code->bytes + code->count, bytes, count);
+	code->count += count;
+}
+
+static void code_push_u32(Code* code, uint32_t value)
+{
+	code_push(code, &value, sizeof(value));
+}
+
+static void code_push_u64(Code* code, uint64_t value)
+{
+	code_push(code, &value, sizeof(value));
+}
+
+static void code_push_le(Code* code, uint64_t value, size_t size)
+{
+	for (size_t i = 0; i < size; i++)
+	{
+		uint8_t byte = (uint8_t)(value >> (8 * i));
+		code_push(code, &byte, 1);
+	}
+}
+
+static void code_patch_le32(Code* code, size_t at, uint32_t value)
+{
+	for (size_t i = 0; i < 4; i++)
+	{
+		code->bytes[at + i] = (uint8_t)(value >> (8 * i));
+	}
+}
+
+static void emit_bytecode_clear(Code* code, int* pending_clear)
+{
+	if (!*pending_clear) return;
+	code_push_le(code, BC_CLEAR, 1);
+	*pending_clear = 0;
+}
+
+// Emits innermost loops that are a clear, a scan or a multiplication
+// as a single instruction. A clear is left pending in pending_clear,
+// so that it can merge with a following shift.
+static int emit_bytecode_loop(Block* loop, Code* code, int* pending_clear)
+{
+	if (loop->next != NULL) return 0;
+	Ops* ops = &loop->ops;
+	if (ops->count == 1 && ops->items[0].tag == OP_TAG_INC && (ops->items[0].as.inc.value & 1))
+	{
+		*pending_clear = 1;
+		return 1;
+	}
+	// A clear before the loop must happen before it.
+	emit_bytecode_clear(code, pending_clear);
+	if (ops->count == 1 && ops->items[0].tag == OP_TAG_SHIFT)
+	{
+		code_push_le(code, BC_SCAN, 1);
+		code_push_le(code, ops->items[0].as.shift.index, 2);
+		return 1;
+	}
+
+	uint16_t offsets[UINT8_MAX];
+	uint8_t factors[UINT8_MAX];
+	size_t count = 0;
+	uint8_t own = 0;
+	uint32_t offset = 0;
+	for (size_t i = 0; i < ops->count; i++)
+	{
+		Op op = ops->items[i];
+		if (op.tag == OP_TAG_SHIFT)
+		{
+			offset = (offset + op.as.shift.index) % BF_MEMORY_SIZE;
+			continue;
+		}
+		if (op.tag != OP_TAG_INC) return 0;
+		if (offset == 0)
+		{
+			own += op.as.inc.value;
+			continue;
+		}
+		size_t j = 0;
+		while (j < count && offsets[j] != offset) j++;
+		if (j == count)
+		{
+			if (count == UINT8_MAX) return 0;
+			offsets[count] = (uint16_t)offset;
+			factors[count++] = 0;
+		}
+		factors[j] += op.as.inc.value;
+	}
+	// The cell must count down by one, so the body runs cell times.
+	if (offset != 0 || own != UINT8_MAX) return 0;
+	code_push_le(code, BC_MUL, 1);
+	code_push_le(code, count, 1);
+	for (size_t i = 0; i < count; i++)
+	{
+		code_push_le(code, offsets[i], 2);
+		code_push_le(code, factors[i], 1);
+	}
+	return 1;
+}
+
+static void emit_bytecode_ops(Block* block, Code* code, Code* data, int* pending_clear)
+{
+	for (size_t i = 0; i < block->ops.count; i++)
+	{
+		Op op = block->ops.items[i];
+		if (*pending_clear && op.tag == OP_TAG_SHIFT)
+		{
+			code_push_le(code, BC_CLEAR_SHIFT, 1);
+			code_push_le(code, op.as.shift.index, 2);
+			*pending_clear = 0;
+			continue;
+		}
+		emit_bytecode_clear(code, pending_clear);
+		switch (op.tag)
+		{
+		case OP_TAG_INC: {
+			if (i + 1 < block->ops.count && block->ops.items[i + 1].tag == OP_TAG_SHIFT)
+			{
+				code_push_le(code, BC_INC_SHIFT, 1);
+				code_push_le(code, op.as.inc.value, 1);
+				code_push_le(code, block->ops.items[++i].as.shift.index, 2);
+			}
+			else
+			{
+				code_push_le(code, BC_INC, 1);
+				code_push_le(code, op.as.inc.value, 1);
+			}
+		} break;
+		case OP_TAG_SHIFT: {
+			code_push_le(code, BC_SHIFT, 1);
+			code_push_le(code, op.as.shift.index, 2);
+		} break;
+		case OP_TAG_READ: {
+			code_push_le(code, BC_READ, 1);
+		} break;
+		case OP_TAG_WRITE: {
+			code_push_le(code, BC_WRITE, 1);
+		} break;
+		case OP_TAG_ECHO: {
+			code_push_le(code, BC_ECHO, 1);
+			code_push_le(code, op.as.echo.write_first, 1);
+		} break;
+		case OP_TAG_MAP: {
+			StreamMap* map = op.as.map.map;
+			code_push_le(code, BC_MAP, 1);
+			code_push_le(code, data->count, 4);
+			code_push(data, map->lengths, sizeof(map->lengths));
+			for (size_t j = 0; j <= UINT8_MAX; j++)
+			{
+				code_push_le(data, map->offsets[j], 4);
+			}
+			if (map->size != 0) code_push(data, map->bytes, map->size);
+		} break;
+		case OP_TAG_PRINT: {
+			PrintRun* run = op.as.print.run;
+			code_push_le(code, BC_PRINT, 1);
+			code_push_le(code, data->count, 4);
+			code_push_le(data, run->inc, 1);
+			code_push_le(data, run->count, 2);
+			code_push(data, run->deltas, run->count);
+		} break;
+		default: {
+			ASSERT(0);
+		} break;
+		}
+	}
+}
+
+// Writes the program as bytecode for bbvm, see bytecode.h.
+static int emit_bytecode(Block* block, FILE* file)
+{
+	Code code = {0};
+	Code data = {0};
+	Blocks loops = {0};
+	size_t* jumps = NULL;
+	int pending_clear = 0;
+	while (1)
+	{
+		if (block->exit != NULL)
+		{
+			if (emit_bytecode_loop(block, &code, &pending_clear))
+			{
+				block = block->exit;
+				continue;
+			}
+			emit_bytecode_clear(&code, &pending_clear);
+			blocks_push(&loops, block);
+			jumps = realloc(jumps, loops.capacity * sizeof(size_t));
+			if (jumps == NULL) crash_alloc_failed();
+			code_push_le(&code, BC_JZ, 1);
+			jumps[loops.count - 1] = code.count;
+			code_push_le(&code, 0, 4);
+		}
+		emit_bytecode_ops(block, &code, &data, &pending_clear);
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			Block* loop = blocks_pop(&loops);
+			size_t jump = jumps[loops.count];
+			emit_bytecode_clear(&code, &pending_clear);
+			code_push_le(&code, BC_JNZ, 1);
+			code_push_le(&code, jump + 4, 4);
+			code_patch_le32(&code, jump, (uint32_t)code.count);
+			block = loop->exit;
+		}
+		else block = block->next;
+	}
+	emit_bytecode_clear(&code, &pending_clear);
+	code_push_le(&code, BC_HALT, 1);
+	free(jumps);
+	free(loops.items);
+
+	Code header = {0};
+	code_push(&header, BYTECODE_MAGIC, 4);
+	code_push_le(&header, BYTECODE_VERSION, 4);
+	code_push_le(&header, BF_MEMORY_SIZE, 4);
+	code_push_le(&header, code.count, 4);
+	code_push_le(&header, data.count, 4);
+	ASSERT(header.count == BYTECODE_HEADER_SIZE);
+	int ok = code.count <= UINT32_MAX && data.count <= UINT32_MAX
+		&& fwrite(header.bytes, 1, header.count, file) == header.count
+		&& fwrite(code.bytes, 1, code.count, file) == code.count
+		&& (data.count == 0 || fwrite(data.bytes, 1, data.count, file) == data.count);
+	free(header.bytes);
+	free(code.bytes);
+	free(data.bytes);
+	return ok;
+}
+
+// Top level ops per region emitted on its own.
+#define EMIT_REGION_OPS 4096
+
+#if RUNNER_SUPPORTED
+
+typedef struct EmitWorker EmitWorker;
+struct EmitWorker
+{
+	EmitRegion* regions;
+	WorkQueue* queues;
+	size_t worker_count;
+	size_t index;
+	Target target;
+	const char* source_path;
+	pthread_t thread;
+};
+
+// Emits the code and the cold loops of regions into buffers.
+static void* emit_worker(void* argument)
+{
+	EmitWorker* worker = argument;
+	size_t index;
+	while (work_take(worker->queues, worker->worker_count, worker->index, &index))
+	{
+		EmitRegion* region = &worker->regions[index];
+		FILE* text = open_memstream(&region->text, &region->text_size);
+		FILE* cold_text = open_memstream(&region->cold_text, &region->cold_text_size);
+		if (text == NULL || cold_text == NULL) crash_alloc_failed();
+		Blocks* cold = (worker->target != TARGET_BF) ? &region->cold : NULL;
+		region->ok = emit_blocks(region->start, region->stop, 0, text, worker->target, region, NULL, cold, worker->source_path)
+			&& emit_cold_loops(region, cold_text, worker->target, NULL, worker->source_path);
+		if (fclose(text) != 0 || fclose(cold_text) != 0) region->ok = 0;
+	}
+	return NULL;
+}
+
+#endif
+
+// Declares the symbols that the parts of a program split by --split share,
+// all defined by the first part, with directive "global" or "extern".
+static int emit_shared_symbols(FILE* file, Target target, uint32_t used_ops, const char* directive)
+{
+	const char* symbols[8];
+	size_t count = 0;
+	symbols[count++] = "mem";
+	symbols[count++] = "bb_read";
+	symbols[count++] = "bb_echo";
+	if (target == TARGET_NASM_LINUX)
+	{
+		symbols[count++] = "tmp";
+		symbols[count++] = "bb_write";
+	}
+	else if (used_ops & (((uint32_t)1 << OP_TAG_MAP) | ((uint32_t)1 << OP_TAG_PRINT))) symbols[count++] = "bb_out";
+	if (used_ops & ((uint32_t)1 << OP_TAG_MAP))
+	{
+		symbols[count++] = "bb_map1";
+		symbols[count++] = "bb_mapn";
+	}
+	if (used_ops & ((uint32_t)1 << OP_TAG_PRINT)) symbols[count++] = "bb_print_buf";
+	for (size_t i = 0; i < count; i++)
+	{
+		if (fprintf(file, "%s %s\n", directive, symbols[i]) < 0) return 0;
+	}
+	return 1;
+}
+
+// Every part after the first starts at bb_part_<part>, which the part before
+// jumps to, and the last one jumps back to bb_done in the first, which exits.
+static int emit_part_head(FILE* file, Target target, size_t part, uint32_t used_ops)
+{
+	if (target == TARGET_NASM_LIBC && fprintf(file, "default rel\nextern putchar\n") < 0) return 0;
+	if (!emit_shared_symbols(file, target, used_ops, "extern")) return 0;
+	if (fprintf(
+		file,
+		"global bb_part_%zu\n"
+		"\n"
+		"section .text\n"
+		"bb_part_%zu:\n",
+		part,
+		part
+	) < 0) return 0;
+	return 1;
+}
+
+static int emit_part_link(FILE* file, size_t part, size_t part_count)
+{
+	if (part_count == 1) return 1;
+	if (part == 0) return fprintf(file, "jmp bb_part_1\nbb_done:\n") >= 0;
+	if (part + 1 == part_count) return fprintf(file, "extern bb_done\njmp bb_done\n") >= 0;
+	return fprintf(file, "extern bb_part_%zu\njmp bb_part_%zu\n", part + 1, part + 1) >= 0;
+}
+
+// Writes execution counts of every block to profile_path at exit,
+// unless profile_path is NULL. Emits line info for source_path,
+// unless it is NULL. Unless thread_count is 1, regions of the program
+// are emitted on up to thread_count threads, into the same text.
+// Regions are spread in order over part_count files, the first of which
+// holds the entry point, the exit and the runtime. Cold loops of the
+// regions of a part follow the code of all of them.
+static int emit_code(
+	Block* block,
+	FILE** files,
+	size_t part_count,
+	Target target,
+	const char* profile_path,
+	const char* source_path,
+	const char* embed_name,
+	int shared,
+	size_t thread_count)
+{
+	ASSERT(part_count == 1 || target == TARGET_NASM_LIBC || target == TARGET_NASM_LINUX);
+	if (target == TARGET_BYTECODE) return emit_bytecode(block, files[0]);
+#if !RUNNER_SUPPORTED
+	thread_count = 1;
+#endif
+	// Profile counters are numbered across the whole program.
+	if (profile_path != NULL) thread_count = 1;
+	Blocks profiled = {0};
+	Blocks* profiled_or_null = (profile_path != NULL) ? &profiled : NULL;
+	size_t region_count;
+	EmitRegion* regions = find_emit_regions(block, (profile_path != NULL) ? SIZE_MAX : EMIT_REGION_OPS, &region_count);
+	uint32_t used_ops = blocks_used_ops(block);
+	int ok = 1;
+	if (part_count > 1) ok = emit_shared_symbols(files[0], target, used_ops, "global") && fprintf(files[0], "global bb_done\nextern bb_part_1\n") >= 0;
+	ok = ok && emit_file_head(files[0], target, embed_name, shared);
+	for (size_t part = 1; part < part_count; part++)
+	{
+		ok = ok && emit_part_head(files[part], target, part, used_ops);
+	}
+	if (thread_count == 1)
+	{
+		for (size_t i = 0; i < region_count; i++)
+		{
+			EmitRegion* region = &regions[i];
+			FILE* file = files[i * part_count / region_count];
+			Blocks* cold = (target != TARGET_BF) ? &region->cold : NULL;
+			ok = ok && emit_blocks(region->start, region->stop, 0, file, target, region, profiled_or_null, cold, source_path);
+		}
+	}
+#if RUNNER_SUPPORTED
+	else
+	{
+		size_t worker_count = (thread_count < region_count) ? thread_count : region_count;
+		EmitWorker* workers = calloc(worker_count, sizeof(EmitWorker));
+		if (workers == NULL) crash_alloc_failed();
+		WorkQueue* queues = work_queues_create(NULL, region_count, worker_count);
+		int* started = calloc(worker_count, sizeof(int));
+		if (started == NULL) crash_alloc_failed();
+		for (size_t i = 0; i < worker_count; i++)
+		{
+			workers[i] = (EmitWorker){ .regions = regions, .queues = queues, .worker_count = worker_count, .index = i, .target = target, .source_path = source_path };
+			if (i != 0) started[i] = pthread_create(&workers[i].thread, NULL, emit_worker, &workers[i]) == 0;
+		}
+		// Regions of workers that failed to start are stolen by the others.
+		emit_worker(&workers[0]);
+		for (size_t i = 1; i < worker_count; i++)
+		{
+			if (started[i]) pthread_join(workers[i].thread, NULL);
+		}
+		free(started);
+		work_queues_destroy(queues, worker_count);
+		free(workers);
+		for (size_t i = 0; i < region_count; i++)
+		{
+			FILE* file = files[i * part_count / region_count];
+			ok = ok && regions[i].ok && fwrite(regions[i].text, 1, regions[i].text_size, file) == regions[i].text_size;
+		}
+	}
+#endif
+	size_t first = 0;
+	for (size_t part = 0; part < part_count; part++)
+	{
+		FILE* file = files[part];
+		ok = ok && emit_part_link(file, part, part_count);
+		int any_cold = 0;
+		size_t end = first;
+		while (end < region_count && end * part_count / region_count == part)
+		{
+			if (regions[end].cold.count != 0) any_cold = 1;
+			end++;
+		}
+		ok = ok && (!any_cold || fprintf(file, "section .text.unlikely progbits alloc exec nowrite align=16\n") >= 0);
+		for (size_t i = first; i < end; i++)
+		{
+			if (thread_count == 1) ok = ok && emit_cold_loops(&regions[i], file, target, profiled_or_null, source_path);
+			else ok = ok && fwrite(regions[i].cold_text, 1, regions[i].cold_text_size, file) == regions[i].cold_text_size;
+			free(regions[i].text);
+			free(regions[i].cold_text);
+		}
+		ok = ok && (!any_cold || fprintf(file, "section .text\n") >= 0);
+		first = end;
+	}
+	FILE* file = files[0];
+	// Line 0 marks the exit code and the runtime as not coming from the source.
+	if (source_path != NULL) ok = ok && emit_source_line(0, source_path, file);
+	if (profile_path != NULL) ok = ok && emit_profile_dump(&profiled, profile_path, file, target);
+	ok = ok && emit_file_tail(file, target, used_ops);
+	for (size_t i = 0; i < region_count; i++)
+	{
+		free(regions[i].cold.items);
+	}
+	free(regions);
+	free(profiled.items);
+	return ok;
+}
+
+// The C declarations of a program emitted by TARGET_NASM_EMBED.
+static int emit_embed_header(FILE* file, const char* name, int shared)
+{
+	if (fprintf(
+		file,
+		"#ifndef BF_%s_H\n"
+		"#define BF_%s_H\n"
+		"\n"
+		"#include <stddef.h>\n"
+		"#include <stdint.h>\n"
+		"\n"
+		"#ifndef BF_IO_DEFINED\n"
+		"#define BF_IO_DEFINED\n"
+		"\n"
+		"// Programs use the first BF_TAPE_SIZE cells of the tape.\n"
+		"#define BF_TAPE_SIZE %d\n"
+		"\n"
+		"#define BF_OK %d\n"
+		"#define BF_ERROR_TAPE %d // tape_len is less than BF_TAPE_SIZE.\n"
+		"#define BF_ERROR_WRITE %d // write returned nonzero.\n"
+		"#define BF_ERROR_ABI %d // bf_init() of a module built for another ABI.\n"
+		"\n"
+		"#define BF_ABI_VERSION %d\n"
+		"\n"
+		"typedef struct bf_io bf_io;\n"
+		"struct bf_io\n"
+		"{\n"
+		"\tvoid* context;\n"
+		"\t// Reads up to size bytes into buffer and returns their count, 0 at the end of input.\n"
+		"\tsize_t (*read)(void* context, uint8_t* buffer, size_t size);\n"
+		"\t// Writes all size bytes of buffer and returns 0, or nonzero to stop the program.\n"
+		"\tint (*write)(void* context, const uint8_t* buffer, size_t size);\n"
+		"};\n"
+		"\n"
+		"// Entry points of modules built with --shared, as found by dlsym().\n"
+		"// bf_init checks abi_version against BF_ABI_VERSION and stores the\n"
+		"// tape size the module needs, unless tape_size is NULL.\n"
+		"typedef int bf_init_fn(uint32_t abi_version, size_t* tape_size);\n"
+		"typedef int bf_run_fn(uint8_t* tape, size_t tape_len, const bf_io* io);\n"
+		"\n"
+		"#endif\n"
+		"\n"
+		"#ifdef __cplusplus\n"
+		"extern \"C\" {\n"
+		"#endif\n"
+		"\n"
+		"// Runs the program from cell 0 of tape, which is left as the program left it.\n"
+		"// Calls may run concurrently on different tapes.\n"
+		"int bf_%s(uint8_t* tape, size_t tape_len, const bf_io* io);\n",
+		name,
+		name,
+		BF_MEMORY_SIZE,
+		EMBED_OK,
+		EMBED_ERROR_TAPE,
+		EMBED_ERROR_WRITE,
+		EMBED_ERROR_ABI,
+		EMBED_ABI_VERSION,
+		name
+	) < 0) return 0;
+	if (shared && fprintf(
+		file,
+		"bf_init_fn bf_init;\n"
+		"bf_run_fn bf_run;\n"
+	) < 0) return 0;
+	if (fprintf(
+		file,
+		"\n"
+		"#ifdef __cplusplus\n"
+		"}\n"
+		"#endif\n"
+		"\n"
+		"#endif\n"
+	) < 0) return 0;
+	return 1;
+}
+
+void print_usage(const char* name)
+{
+	fprintf(
+		stderr,
+		"Usage: %s <input>\n"
+		"input - path to input file.\n"
+		"flags:\n"
+		"-h - prints this message.\n"
+		"-o filename - sepcify path to output file.\n"
+		"              If output path is not specified,\n"
+		"              program will write to stdout.\n"
+		"--help - prints this message.\n"
+		"--libc - set target to libc (default).\n"
+		"--linux - set target to linux.\n"
+		"--brain - generates brainf*ck insted of assembly.\n"
+		"--bytecode - generates bytecode for bbvm instead of assembly.\n"
+		"--embed=name - generates a function bf_name(tape, tape_len, io) that\n"
+		"               does I/O through the callbacks in io.\n"
+		"--header=filename - writes the C header of the --embed function to filename.\n"
+		"--shared - makes --embed output position independent code for a shared\n"
+		"           library that also exports bf_init and bf_run.\n"
+		"--split=count - writes --libc or --linux assembly as count files, so\n"
+		"                they can be assembled in parallel and linked together:\n"
+		"                -o out.asm writes out.0.asm, out.1.asm and so on.\n"
+		"-O0 - disables optimizations.\n"
+		"-j count - optimizes independent top level loop nests and emits top level\n"
+		"           regions on count threads (default 1), with the same output\n"
+		"           and remarks.\n"
+		"--run - compiles the program to machine code in memory and runs it\n"
+		"        on stdin and stdout instead of writing assembly.\n"
+		"--interpret - like --run, but interprets the program.\n"
+		"--parallel - like --run, but runs consecutive loop nests that do no I/O\n"
+		"             and touch disjoint cells on --threads threads.\n"
+		"--pipeline - runs all input files like `a | b | c` in one process, each on\n"
+		"             its own thread, connected by in memory ring buffers.\n"
+		"--fork-server - like --run, but runs the program in a fresh child process\n"
+		"                for every request of an AFL style fork server client\n"
+		"                on file descriptors 198 and 199.\n"
+		"--heatmap=filename - like --interpret, but also writes reads, writes and\n"
+		"                     pointer visits of every cell per million steps\n"
+		"                     to filename as CSV.\n"
+		"--remarks[=filename] - writes every optimization decision, with the source\n"
+		"                       span it applies to, as JSON lines to filename\n"
+		"                       (default stderr).\n"
+		"--stats - prints phase timings, bytes written, peak memory\n"
+		"          and IR metrics to stderr.\n"
+		"--trace=filename - writes phase timings as a Chrome trace.\n"
+		"--bench - runs the program in fresh processes and prints wall, user\n"
+		"          and sys time, instructions and cycles as JSON.\n"
+		"--input filename - input of --bench runs (default /dev/null).\n"
+		"--runs count - number of --bench runs (default 10).\n"
+		"--runner jobs - runs every line `program input output` of the file jobs\n"
+		"                on a pool of threads, compiling each program once, and\n"
+		"                prints the status and time of every job as JSON lines.\n"
+		"                With --interpret the programs are interpreted.\n"
+		"--threads count - number of --runner or --parallel threads\n"
+		"                  (default one per processor).\n"
+		"--fuel count - stops --runner jobs after count loop iterations.\n"
+		"--lanes count - makes --runner interpret up to count (at most 64) jobs of\n"
+		"                one program in lockstep, one in each byte of a vector.\n"
+		"--perf-map - makes --run describe the compiled code in /tmp/perf-<pid>.map,\n"
+		"             so perf attributes samples to source loops.\n"
+		"-g - emits %%line directives, so debug info from nasm -g\n"
+		"     maps instructions back to the source.\n"
+		"--profile[=filename] - makes the program write execution counts\n"
+		"                       of every block to filename (default " PROFILE_DEFAULT_PATH ")\n"
+		"                       when it exits.\n"
+		"--print-profile filename - prints a profile, hottest blocks first.\n"
+		"--ir-cache=filename - loads the optimized IR from filename if it was written\n"
+		"                      for the same source, flags and compiler, otherwise\n"
+		"                      writes it there, skipping parsing and optimization\n"
+		"                      on later compiles.\n"
+		"--use-profile=filename - aligns and unrolls loops that are hot in a profile\n"
+		"                         and moves loops that never ran out of line.\n",
+		name);
+}
+
+void print_file_not_opened(const char* path, const char* purpose)
+{
+	fprintf(
+		stderr,
+		"error: Failed to open %s for %s: %s\n",
+		path,
+		purpose,
+		strerror(errno));
+}
+
+// Counts of cell accesses in windows of HEATMAP_WINDOW_STEPS executed
+// ops and loop checks, written to a CSV file as they fill up.
+#define HEATMAP_WINDOW_STEPS (1 << 20)
+
+typedef struct Heatmap Heatmap;
+struct Heatmap
+{
+	FILE* file;
+	uint64_t steps;
+	uint64_t reads[BF_MEMORY_SIZE];
+	uint64_t writes[BF_MEMORY_SIZE];
+	// Steps executed with the pointer at the cell.
+	uint64_t visits[BF_MEMORY_SIZE];
+	uint8_t touched[BF_MEMORY_SIZE];
+};
+
+// State of a program executed in process by --run.
+typedef struct Machine Machine;
+struct Machine
+{
+	uint8_t cells[BF_MEMORY_SIZE];
+	size_t ptr;
+	FILE* input;
+	FILE* output;
+	Heatmap* heatmap; // NULL unless accesses are counted.
+	// Unless fueled is 0, every loop iteration takes one unit of fuel and
+	// the program stops with out_of_fuel set once there is none left.
+	int fueled;
+	uint8_t out_of_fuel;
+	uint64_t fuel;
+	// Every cell the pointer visited since the last snapshot is in [low, high].
+	size_t low;
+	size_t high;
+};
+
+static int heatmap_flush(Heatmap* heatmap)
+{
+	uint64_t window = (heatmap->steps - 1) / HEATMAP_WINDOW_STEPS;
+	for (size_t i = 0; i < BF_MEMORY_SIZE; i++)
+	{
+		if (heatmap->reads[i] == 0 && heatmap->writes[i] == 0 && heatmap->visits[i] == 0) continue;
+		if (fprintf(
+			heatmap->file,
+			"%" PRIu64 ",%zu,%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+			window,
+			i,
+			heatmap->reads[i],
+			heatmap->writes[i],
+			heatmap->visits[i]
+		) < 0) return 0;
+	}
+	memset(heatmap->reads, 0, sizeof(heatmap->reads));
+	memset(heatmap->writes, 0, sizeof(heatmap->writes));
+	memset(heatmap->visits, 0, sizeof(heatmap->visits));
+	return 1;
+}
+
+static void heatmap_count(Machine* machine, uint64_t reads, uint64_t writes)
+{
+	Heatmap* heatmap = machine->heatmap;
+	if (heatmap == NULL) return;
+	heatmap->reads[machine->ptr] += reads;
+	heatmap->writes[machine->ptr] += writes;
+	heatmap->touched[machine->ptr] = 1;
+}
+
+static void heatmap_step(Machine* machine)
+{
+	Heatmap* heatmap = machine->heatmap;
+	if (heatmap == NULL) return;
+	heatmap->visits[machine->ptr]++;
+	heatmap->steps++;
+	if (heatmap->steps % HEATMAP_WINDOW_STEPS == 0 && !heatmap_flush(heatmap))
+	{
+		fprintf(stderr, "warning: Failed to write heatmap, stopped counting.\n");
+		machine->heatmap = NULL;
+	}
+}
+
+static uint8_t machine_read(Machine* machine)
+{
+	int c = getc(machine->input);
+	return (c == EOF) ? 0 : (uint8_t)c;
+}
+
+// Executes an op on the current cell.
+static void machine_op(Machine* machine, const Op* op)
+{
+	uint8_t* cell = &machine->cells[machine->ptr];
+	switch (op->tag)
+	{
+	case OP_TAG_INC: {
+		*cell += op->as.inc.value;
+		heatmap_count(machine, 1, 1);
+	} break;
+	case OP_TAG_SHIFT: {
+		machine->ptr = (machine->ptr + op->as.shift.index) % BF_MEMORY_SIZE;
+		if (machine->ptr < machine->low) machine->low = machine->ptr;
+		if (machine->ptr > machine->high) machine->high = machine->ptr;
+	} break;
+	case OP_TAG_READ: {
+		*cell = machine_read(machine);
+		heatmap_count(machine, 0, 1);
+	} break;
+	case OP_TAG_WRITE: {
+		putc(*cell, machine->output);
+		heatmap_count(machine, 1, 0);
+	} break;
+	case OP_TAG_ECHO: {
+		// Counted like the loop it was lowered from.
+		heatmap_count(machine, 1, 0);
+		while (*cell != 0)
+		{
+			if (op->as.echo.write_first) putc(*cell, machine->output);
+			*cell = machine_read(machine);
+			if (!op->as.echo.write_first) putc(*cell, machine->output);
+			heatmap_count(machine, 2, 1);
+		}
+	} break;
+	case OP_TAG_MAP: {
+		StreamMap* map = op->as.map.map;
+		heatmap_count(machine, 1, 0);
+		while (*cell != 0)
+		{
+			fwrite(map->bytes + map->offsets[*cell], 1, map->lengths[*cell], machine->output);
+			*cell = machine_read(machine);
+			heatmap_count(machine, 2, 1);
+		}
+	} break;
+	case OP_TAG_PRINT: {
+		PrintRun* run = op->as.print.run;
+		for (size_t i = 0; i < run->count; i++)
+		{
+			putc((uint8_t)(*cell + run->deltas[i]), machine->output);
+		}
+		*cell += run->inc;
+		heatmap_count(machine, run->count, 1);
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+}
+
+// Stops before stop if it is reached outside of every loop.
+static void interpret_until(Machine* machine, Block* block, Block* stop)
+{
+	Blocks loops = {0};
+	while (1)
+	{
+		if (loops.count == 0 && block == stop) break;
+		if (block->exit != NULL)
+		{
+			heatmap_count(machine, 1, 0);
+			heatmap_step(machine);
+			if (machine->cells[machine->ptr] == 0)
+			{
+				block = block->exit;
+				continue;
+			}
+			blocks_push(&loops, block);
+		}
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			machine_op(machine, &block->ops.items[i]);
+			heatmap_step(machine);
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			if (machine->fueled && machine->fuel-- == 0)
+			{
+				machine->out_of_fuel = 1;
+				break;
+			}
+			Block* loop = blocks_pop(&loops);
+			block = (machine->cells[machine->ptr] != 0) ? loop : loop->exit;
+		}
+		else block = block->next;
+	}
+	free(loops.items);
+}
+
+static void interpret(Machine* machine, Block* block)
+{
+	interpret_until(machine, block, NULL);
+}
+
+// Tape of a Machine saved by machine_snapshot().
+typedef struct MachineSnapshot MachineSnapshot;
+struct MachineSnapshot
+{
+	uint8_t cells[BF_MEMORY_SIZE];
+	size_t ptr;
+};
+
+static void machine_snapshot(Machine* machine, MachineSnapshot* snapshot)
+{
+	memcpy(snapshot->cells, machine->cells, sizeof(snapshot->cells));
+	snapshot->ptr = machine->ptr;
+	machine->low = machine->ptr;
+	machine->high = machine->ptr;
+}
+
+// Only copies back the cells the pointer visited since the snapshot,
+// the program can't have changed any other.
+static void machine_restore(Machine* machine, const MachineSnapshot* snapshot)
+{
+	memcpy(machine->cells + machine->low, snapshot->cells + machine->low, machine->high - machine->low + 1);
+	machine->ptr = snapshot->ptr;
+	machine->low = machine->ptr;
+	machine->high = machine->ptr;
+	machine->out_of_fuel = 0;
+}
+
+#if JIT_SUPPORTED
+
+#define JIT_FUELED 1 // Loops take fuel from the Machine, see interpret().
+#define JIT_TRACKED 2 // Shifts keep Machine.low and Machine.high up to date.
+
+static void code_patch_rel32(Code* code, size_t at, size_t target)
+{
+	int32_t rel = (int32_t)((int64_t)target - (int64_t)(at + 4));
+	memcpy(code->bytes + at, &rel, sizeof(rel));
+}
+
+// Start of a run of code that belongs to loop, or to no loop if loop is NULL.
+typedef struct CodeRegion CodeRegion;
+struct CodeRegion
+{
+	size_t start;
+	Block* loop;
+};
+
+typedef struct CodeRegions CodeRegions;
+struct CodeRegions
+{
+	size_t capacity;
+	size_t count;
+	CodeRegion* items;
+};
+
+static void code_regions_push(CodeRegions* regions, size_t start, Block* loop)
+{
+	if (regions->count == regions->capacity)
+	{
+		ASSERT(regions->capacity <= SIZE_MAX / sizeof(CodeRegion) / 2);
+		regions->capacity = (regions->capacity == 0) ? 1 : regions->capacity * 2;
+		regions->items = realloc(regions->items, regions->capacity * sizeof(CodeRegion));
+		if (regions->items == NULL) crash_alloc_failed();
+	}
+	regions->items[regions->count++] = (CodeRegion){ .start = start, .loop = loop };
+}
+
+// Compiles to a function that takes the Machine* in rdi.
+// rbx holds the tape, r12 the cell index and r13 the machine.
+// Fueled code checks Machine fuel at the end of every loop iteration.
+// Compiles the blocks from block up to stop, see interpret_until().
+static void jit_compile(Block* block, Block* stop, Code* code, CodeRegions* regions, int options)
+{
+	static const uint8_t prologue[] = {
+		0x53,                         // push rbx
+		0x41, 0x54,                   // push r12
+		0x41, 0x55,                   // push r13
+		0x49, 0x89, 0xfd,             // mov r13, rdi
+		0x48, 0x8d, 0x5f,             // lea rbx, [rdi + cells]
+		(uint8_t)offsetof(Machine, cells),
+		0x4c, 0x8b, 0xa7,             // mov r12, [rdi + ptr]
+	};
+	static const uint8_t epilogue[] = {
+		0x41, 0x5d,                   // pop r13
+		0x41, 0x5c,                   // pop r12
+		0x5b,                         // pop rbx
+		0xc3,                         // ret
+	};
+	static const uint8_t store_ptr[] = { 0x4d, 0x89, 0xa5 }; // mov [r13 + ptr], r12
+	static const uint8_t compare_cell[] = { 0x42, 0x80, 0x3c, 0x23, 0x00 }; // cmp byte [rbx + r12], 0
+
+	code_push(code, prologue, sizeof(prologue));
+	code_push_u32(code, (uint32_t)offsetof(Machine, ptr));
+	if (options & JIT_TRACKED)
+	{
+		// The visited range lives in r14 and r15, pushing both keeps the stack aligned.
+		code_push(code, (uint8_t[]){ 0x41, 0x56, 0x41, 0x57 }, 4); // push r14; push r15
+		code_push(code, (uint8_t[]){ 0x4d, 0x8b, 0xb5 }, 3);       // mov r14, [r13 + low]
+		code_push_u32(code, (uint32_t)offsetof(Machine, low));
+		code_push(code, (uint8_t[]){ 0x4d, 0x8b, 0xbd }, 3);       // mov r15, [r13 + high]
+		code_push_u32(code, (uint32_t)offsetof(Machine, high));
+	}
+	code_regions_push(regions, 0, NULL);
+
+	Blocks loops = {0};
+	size_t* heads = NULL;
+	size_t* fuel_jumps = NULL; // Jumps taken when fuel runs out.
+	size_t fuel_jump_count = 0;
+	while (1)
+	{
+		if (loops.count == 0 && block == stop) break;
+		if (block->exit != NULL)
+		{
+			blocks_push(&loops, block);
+			heads = realloc(heads, loops.capacity * sizeof(size_t));
+			if (heads == NULL) crash_alloc_failed();
+			heads[loops.count - 1] = code->count;
+			code_regions_push(regions, code->count, block);
+			code_push(code, compare_cell, sizeof(compare_cell));
+			code_push(code, (uint8_t[]){ 0x0f, 0x84 }, 2); // je end
+			code_push_u32(code, 0);
+		}
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			Op* op = &block->ops.items[i];
+			switch (op->tag)
+			{
+			case OP_TAG_INC: {
+				// add byte [rbx + r12], value
+				code_push(code, (uint8_t[]){ 0x42, 0x80, 0x04, 0x23, op->as.inc.value }, 5);
+			} break;
+			case OP_TAG_SHIFT: {
+				code_push(code, (uint8_t[]){ 0x49, 0x81, 0xc4 }, 3); // add r12, index
+				code_push_u32(code, op->as.shift.index);
+				code_push(code, (uint8_t[]){ 0x49, 0x81, 0xfc }, 3); // cmp r12, size
+				code_push_u32(code, BF_MEMORY_SIZE);
+				code_push(code, (uint8_t[]){ 0x72, 0x07 }, 2);       // jb done
+				code_push(code, (uint8_t[]){ 0x49, 0x81, 0xec }, 3); // sub r12, size
+				code_push_u32(code, BF_MEMORY_SIZE);
+				if (options & JIT_TRACKED)
+				{
+					code_push(code, (uint8_t[]){ 0x4d, 0x3b, 0xe6 }, 3);       // cmp r12, r14
+					code_push(code, (uint8_t[]){ 0x4d, 0x0f, 0x42, 0xf4 }, 4); // cmovb r14, r12
+					code_push(code, (uint8_t[]){ 0x4d, 0x3b, 0xe7 }, 3);       // cmp r12, r15
+					code_push(code, (uint8_t[]){ 0x4d, 0x0f, 0x47, 0xfc }, 4); // cmova r15, r12
+				}
+			} break;
+			default: {
+				code_push(code, store_ptr, sizeof(store_ptr));
+				code_push_u32(code, (uint32_t)offsetof(Machine, ptr));
+				code_push(code, (uint8_t[]){ 0x4c, 0x89, 0xef }, 3); // mov rdi, r13
+				code_push(code, (uint8_t[]){ 0x48, 0xbe }, 2);       // mov rsi, op
+				code_push_u64(code, (uint64_t)(uintptr_t)op);
+				code_push(code, (uint8_t[]){ 0x48, 0xb8 }, 2);       // mov rax, machine_op
+				code_push_u64(code, (uint64_t)(uintptr_t)&machine_op);
+				code_push(code, (uint8_t[]){ 0xff, 0xd0 }, 2);       // call rax
+			} break;
+			}
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			Block* loop = blocks_pop(&loops);
+			size_t head = heads[loops.count];
+			if (options & JIT_FUELED)
+			{
+				code_push(code, (uint8_t[]){ 0x49, 0x83, 0xad }, 3); // sub qword [r13 + fuel], 1
+				code_push_u32(code, (uint32_t)offsetof(Machine, fuel));
+				code_push(code, (uint8_t[]){ 0x01, 0x0f, 0x82 }, 3); // jb out_of_fuel
+				code_push_u32(code, 0);
+				fuel_jumps = realloc(fuel_jumps, (fuel_jump_count + 1) * sizeof(size_t));
+				if (fuel_jumps == NULL) crash_alloc_failed();
+				fuel_jumps[fuel_jump_count++] = code->count - 4;
+			}
+			code_push(code, (uint8_t[]){ 0xe9 }, 1); // jmp head
+			code_push_u32(code, 0);
+			code_patch_rel32(code, code->count - 4, head);
+			code_patch_rel32(code, head + sizeof(compare_cell) + 2, code->count);
+			code_regions_push(regions, code->count, (loops.count == 0) ? NULL : loops.items[loops.count - 1]);
+			block = loop->exit;
+		}
+		else block = block->next;
+	}
+	size_t exit = code->count;
+	code_push(code, store_ptr, sizeof(store_ptr));
+	code_push_u32(code, (uint32_t)offsetof(Machine, ptr));
+	if (options & JIT_TRACKED)
+	{
+		code_push(code, (uint8_t[]){ 0x4d, 0x89, 0xb5 }, 3);       // mov [r13 + low], r14
+		code_push_u32(code, (uint32_t)offsetof(Machine, low));
+		code_push(code, (uint8_t[]){ 0x4d, 0x89, 0xbd }, 3);       // mov [r13 + high], r15
+		code_push_u32(code, (uint32_t)offsetof(Machine, high));
+		code_push(code, (uint8_t[]){ 0x41, 0x5f, 0x41, 0x5e }, 4); // pop r15; pop r14
+	}
+	code_push(code, epilogue, sizeof(epilogue));
+	if (fuel_jump_count != 0)
+	{
+		for (size_t i = 0; i < fuel_jump_count; i++)
+		{
+			code_patch_rel32(code, fuel_jumps[i], code->count);
+		}
+		code_push(code, (uint8_t[]){ 0x41, 0xc6, 0x85 }, 3); // mov byte [r13 + out_of_fuel], 1
+		code_push_u32(code, (uint32_t)offsetof(Machine, out_of_fuel));
+		code_push(code, (uint8_t[]){ 0x01, 0xe9 }, 2);       // jmp exit
+		code_push_u32(code, 0);
+		code_patch_rel32(code, code->count - 4, exit);
+	}
+	free(fuel_jumps);
+	free(heads);
+	free(loops.items);
+}
+
+// Names every region of code after the source range of its loop, so that
+// perf attributes samples to loops.
+static int write_perf_map(uint8_t* code, size_t size, CodeRegions* regions, const char* source_path)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/perf-%ld.map", (long)getpid());
+	FILE* file = fopen(path, "a");
+	if (file == NULL)
+	{
+		print_file_not_opened(path, "writing");
+		return 0;
+	}
+	for (size_t i = 0; i < regions->count; i++)
+	{
+		size_t start = regions->items[i].start;
+		size_t end = (i + 1 < regions->count) ? regions->items[i + 1].start : size;
+		if (start == end) continue;
+		Block* loop = regions->items[i].loop;
+		int written = (loop == NULL)
+			? fprintf(file, "%" PRIxPTR " %zx bf_program %s\n", (uintptr_t)(code + start), end - start, source_path)
+			: fprintf(
+				file,
+				"%" PRIxPTR " %zx bf_loop %s:%" PRIu32 ":%" PRIu32 "-%" PRIu32 ":%" PRIu32 "\n",
+				(uintptr_t)(code + start),
+				end - start,
+				source_path,
+				loop->line,
+				loop->column,
+				loop->exit->line,
+				loop->exit->column);
+		if (written < 0)
+		{
+			fclose(file);
+			return 0;
+		}
+	}
+	return fclose(file) == 0;
+}
+
+typedef struct JitProgram JitProgram;
+struct JitProgram
+{
+	void (*function)(Machine*);
+	size_t size;
+};
+
+// Returns 0 if executable memory is not available.
+static int jit_load(JitProgram* program, Block* block, Block* stop, const char* perf_map_source, int options)
+{
+	Code code = {0};
+	CodeRegions regions = {0};
+	jit_compile(block, stop, &code, &regions, options);
+	void* memory = mmap(NULL, code.count, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) goto fail;
+	memcpy(memory, code.bytes, code.count);
+	if (mprotect(memory, code.count, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(memory, code.count);
+		goto fail;
+	}
+	if (perf_map_source != NULL && !write_perf_map(memory, code.count, &regions, perf_map_source))
+	{
+		fprintf(stderr, "warning: Failed to write perf map.\n");
+	}
+	program->function = (void (*)(Machine*))memory;
+	program->size = code.count;
+	free(code.bytes);
+	free(regions.items);
+	return 1;
+fail:
+	free(code.bytes);
+	free(regions.items);
+	return 0;
+}
+
+static void jit_unload(JitProgram* program)
+{
+	munmap((void*)program->function, program->size);
+}
+
+#endif
+
+// Writes the last window of the heatmap and a summary of the touched cells.
+static int heatmap_finish(Heatmap* heatmap)
+{
+	if (heatmap->steps % HEATMAP_WINDOW_STEPS != 0 && !heatmap_flush(heatmap)) return 0;
+	size_t touched = 0;
+	size_t lowest = BF_MEMORY_SIZE;
+	size_t highest = 0;
+	for (size_t i = 0; i < BF_MEMORY_SIZE; i++)
+	{
+		if (!heatmap->touched[i]) continue;
+		touched++;
+		if (i < lowest) lowest = i;
+		highest = i;
+	}
+	if (touched == 0) fprintf(stderr, "heatmap: no cells touched in %" PRIu64 " steps\n", heatmap->steps);
+	else fprintf(
+		stderr,
+		"heatmap: %zu of " BF_MEMORY_SIZE_STR " cells touched, between %zu and %zu, in %" PRIu64 " steps\n",
+		touched,
+		lowest,
+		highest,
+		heatmap->steps);
+	return 1;
+}
+
+// Runs the blocks from block up to stop, compiled to machine code if possible.
+static void run_until(Machine* machine, Block* block, Block* stop, int jit, const char* perf_map_source)
+{
+#if JIT_SUPPORTED
+	JitProgram program;
+	if (jit && jit_load(&program, block, stop, perf_map_source, 0))
+	{
+		program.function(machine);
+		jit_unload(&program);
+	}
+	else interpret_until(machine, block, stop);
+#else
+	(void)jit;
+	(void)perf_map_source;
+	interpret_until(machine, block, stop);
+#endif
+}
+
+#if RUNNER_SUPPORTED
+
+// Consecutive top level loop nests that do no I/O and touch disjoint cells,
+// with at most shifts between them, so they can run at the same time.
+typedef struct NestGroup NestGroup;
+struct NestGroup
+{
+	size_t capacity;
+	size_t count;
+	Block** nests;
+	size_t* ptrs; // Pointer at the entry of every nest.
+	uint8_t* footprints; // BF_MEMORY_SIZE flags per nest, set for every cell it accesses.
+};
+
+typedef struct NestGroups NestGroups;
+struct NestGroups
+{
+	size_t capacity;
+	size_t count;
+	NestGroup* items;
+};
+
+// Marks every cell the nest of loop accesses when it starts at ptr.
+// Returns 0 if some loop in it doesn't end where it started,
+// so the pointer after it isn't known, and sets pure unless it does I/O.
+static int nest_footprint(Block* loop, size_t ptr, uint8_t* footprint, int* pure)
+{
+	Blocks loops = {0};
+	size_t* starts = NULL;
+	Block* block = loop;
+	int balanced = 1;
+	*pure = 1;
+	while (balanced)
+	{
+		if (block->exit != NULL)
+		{
+			blocks_push(&loops, block);
+			starts = realloc(starts, loops.capacity * sizeof(size_t));
+			if (starts == NULL) crash_alloc_failed();
+			starts[loops.count - 1] = ptr;
+			footprint[ptr] = 1;
+		}
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			Op* op = &block->ops.items[i];
+			if (op->tag == OP_TAG_SHIFT) ptr = (ptr + op->as.shift.index) % BF_MEMORY_SIZE;
+			else if (op->tag == OP_TAG_INC) footprint[ptr] = 1;
+			else
+			{
+				footprint[ptr] = 1;
+				*pure = 0;
+			}
+		}
+		if (block->next == NULL)
+		{
+			Block* done = blocks_pop(&loops);
+			if (starts[loops.count] != ptr) balanced = 0;
+			if (done == loop) break;
+			block = done->exit;
+		}
+		else block = block->next;
+	}
+	free(starts);
+	free(loops.items);
+	return balanced;
+}
+
+static void nest_groups_close(NestGroups* groups, NestGroup* group)
+{
+	if (group->count >= 2)
+	{
+		if (groups->count == groups->capacity)
+		{
+			groups->capacity = (groups->capacity == 0) ? 4 : groups->capacity * 2;
+			groups->items = realloc(groups->items, groups->capacity * sizeof(NestGroup));
+			if (groups->items == NULL) crash_alloc_failed();
+		}
+		groups->items[groups->count++] = *group;
+	}
+	else
+	{
+		free(group->nests);
+		free(group->ptrs);
+		free(group->footprints);
+	}
+	*group = (NestGroup){0};
+}
+
+// Finds the groups of independent nests while the pointer is known at compile time.
+static NestGroups find_nest_groups(Block* block)
+{
+	NestGroups groups = {0};
+	NestGroup group = {0};
+	uint8_t* footprint = malloc(BF_MEMORY_SIZE);
+	if (footprint == NULL) crash_alloc_failed();
+	size_t ptr = 0;
+	while (block != NULL)
+	{
+		if (block->exit == NULL)
+		{
+			for (size_t i = 0; i < block->ops.count; i++)
+			{
+				Op* op = &block->ops.items[i];
+				if (op->tag == OP_TAG_SHIFT) ptr = (ptr + op->as.shift.index) % BF_MEMORY_SIZE;
+				else nest_groups_close(&groups, &group);
+			}
+			block = block->next;
+			continue;
+		}
+		memset(footprint, 0, BF_MEMORY_SIZE);
+		int pure;
+		if (!nest_footprint(block, ptr, footprint, &pure)) break;
+		int disjoint = pure;
+		for (size_t i = 0; i < group.count && disjoint; i++)
+		{
+			uint8_t* other = group.footprints + i * BF_MEMORY_SIZE;
+			for (size_t cell = 0; cell < BF_MEMORY_SIZE && disjoint; cell++)
+			{
+				if (footprint[cell] && other[cell]) disjoint = 0;
+			}
+		}
+		if (!disjoint) nest_groups_close(&groups, &group);
+		if (pure)
+		{
+			if (group.count == group.capacity)
+			{
+				group.capacity = (group.capacity == 0) ? 4 : group.capacity * 2;
+				group.nests = realloc(group.nests, group.capacity * sizeof(Block*));
+				group.ptrs = realloc(group.ptrs, group.capacity * sizeof(size_t));
+				group.footprints = realloc(group.footprints, group.capacity * BF_MEMORY_SIZE);
+				if (group.nests == NULL || group.ptrs == NULL || group.footprints == NULL) crash_alloc_failed();
+			}
+			group.nests[group.count] = block;
+			group.ptrs[group.count] = ptr;
+			memcpy(group.footprints + group.count * BF_MEMORY_SIZE, footprint, BF_MEMORY_SIZE);
+			group.count++;
+		}
+		block = block->exit;
+	}
+	nest_groups_close(&groups, &group);
+	free(footprint);
+	return groups;
+}
+
+typedef struct NestWorker NestWorker;
+struct NestWorker
+{
+	NestGroup* group;
+	size_t first;
+	size_t step;
+	int jit;
+	Machine* machine; // Copy of the tape before the group.
+	pthread_t thread;
+};
+
+static void* nest_worker(void* argument)
+{
+	NestWorker* worker = argument;
+	NestGroup* group = worker->group;
+	for (size_t i = worker->first; i < group->count; i += worker->step)
+	{
+		worker->machine->ptr = group->ptrs[i];
+		run_until(worker->machine, group->nests[i], group->nests[i]->exit, worker->jit, NULL);
+	}
+	return NULL;
+}
+
+// Runs the nests of the group on up to thread_count threads, each on its
+// own copy of the tape, then copies the cells of every nest back.
+static void run_nest_group(Machine* machine, NestGroup* group, size_t thread_count, int jit)
+{
+	if (thread_count > group->count) thread_count = group->count;
+	NestWorker* workers = calloc(thread_count, sizeof(NestWorker));
+	if (workers == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < thread_count; i++)
+	{
+		Machine* copy = malloc(sizeof(Machine));
+		if (copy == NULL) crash_alloc_failed();
+		memcpy(copy, machine, sizeof(Machine));
+		workers[i] = (NestWorker){ .group = group, .first = i, .step = thread_count, .jit = jit, .machine = copy };
+	}
+	int* started = calloc(thread_count, sizeof(int));
+	if (started == NULL) crash_alloc_failed();
+	for (size_t i = 1; i < thread_count; i++)
+	{
+		started[i] = pthread_create(&workers[i].thread, NULL, nest_worker, &workers[i]) == 0;
+	}
+	nest_worker(&workers[0]);
+	for (size_t i = 1; i < thread_count; i++)
+	{
+		if (started[i]) pthread_join(workers[i].thread, NULL);
+		else nest_worker(&workers[i]);
+	}
+	for (size_t i = 0; i < group->count; i++)
+	{
+		const uint8_t* footprint = group->footprints + i * BF_MEMORY_SIZE;
+		const Machine* copy = workers[i % thread_count].machine;
+		for (size_t cell = 0; cell < BF_MEMORY_SIZE; cell++)
+		{
+			if (footprint[cell]) machine->cells[cell] = copy->cells[cell];
+		}
+	}
+	machine->ptr = group->ptrs[group->count - 1];
+	for (size_t i = 0; i < thread_count; i++)
+	{
+		free(workers[i].machine);
+	}
+	free(started);
+	free(workers);
+}
+
+// Like run_until(), but runs groups of independent nests on thread_count threads.
+static void run_parallel(Machine* machine, Block* block, size_t thread_count, int jit, const char* perf_map_source)
+{
+	NestGroups groups = find_nest_groups(block);
+	for (size_t i = 0; i < groups.count; i++)
+	{
+		NestGroup* group = &groups.items[i];
+		run_until(machine, block, group->nests[0], jit, perf_map_source);
+		run_nest_group(machine, group, thread_count, jit);
+		block = group->nests[group->count - 1]->exit;
+		free(group->nests);
+		free(group->ptrs);
+		free(group->footprints);
+	}
+	run_until(machine, block, NULL, jit, perf_map_source);
+	free(groups.items);
+}
+
+#endif
+
+// Runs the program on stdin and stdout, compiled to machine code if possible.
+// Describes the compiled code in a perf map, unless perf_map_source is NULL.
+// Counts cell accesses into heatmap, which needs the interpreter,
+// unless heatmap is NULL. Unless thread_count is 1, independent loop nests
+// run on up to thread_count threads.
+static void run(Block* block, int jit, const char* perf_map_source, Heatmap* heatmap, size_t thread_count)
+{
+	Machine* machine = calloc(1, sizeof(Machine));
+	if (machine == NULL) crash_alloc_failed();
+	machine->input = stdin;
+	machine->output = stdout;
+	machine->heatmap = heatmap;
+	if (heatmap != NULL)
+	{
+		jit = 0;
+		thread_count = 1;
+	}
+#if RUNNER_SUPPORTED
+	if (thread_count > 1) run_parallel(machine, block, thread_count, jit, perf_map_source);
+	else run_until(machine, block, NULL, jit, perf_map_source);
+#else
+	(void)thread_count;
+	run_until(machine, block, NULL, jit, perf_map_source);
+#endif
+	fflush(machine->output);
+	if (machine->heatmap != NULL && !heatmap_finish(machine->heatmap))
+	{
+		fprintf(stderr, "warning: Failed to write heatmap.\n");
+	}
+	free(machine);
+}
+
+#if FORK_SERVER_SUPPORTED
+
+// File descriptors of the fork server protocol of AFL.
+#define FORK_SERVER_CONTROL_FD 198
+#define FORK_SERVER_STATUS_FD 199
+
+// Compiles the program once, then runs it in a fresh child on stdin and stdout
+// every time 4 bytes arrive on FORK_SERVER_CONTROL_FD. The pid of the child,
+// and once it exits its wait status, are written to FORK_SERVER_STATUS_FD.
+// Stops when the control pipe is closed.
+static int fork_server(Block* block, int jit)
+{
+	void (*function)(Machine*) = NULL;
+#if JIT_SUPPORTED
+	JitProgram program;
+	if (jit && jit_load(&program, block, NULL, NULL, 0)) function = program.function;
+#else
+	(void)jit;
+#endif
+	Machine* machine = malloc(sizeof(Machine));
+	if (machine == NULL) crash_alloc_failed();
+	uint32_t message = 0;
+	int ok = write(FORK_SERVER_STATUS_FD, &message, sizeof(message)) == sizeof(message);
+	if (!ok) fprintf(stderr, "error: --fork-server needs its status pipe on fd %d.\n", FORK_SERVER_STATUS_FD);
+	fflush(stdout);
+	while (ok && read(FORK_SERVER_CONTROL_FD, &message, sizeof(message)) == sizeof(message))
+	{
+		pid_t child = fork();
+		if (child == 0)
+		{
+			close(FORK_SERVER_CONTROL_FD);
+			close(FORK_SERVER_STATUS_FD);
+			memset(machine, 0, sizeof(Machine));
+			machine->input = stdin;
+			machine->output = stdout;
+			if (function != NULL) function(machine);
+			else interpret(machine, block);
+			_exit(fflush(stdout) != 0);
+		}
+		int32_t pid = (int32_t)child;
+		int status = 0;
+		ok = child > 0
+			&& write(FORK_SERVER_STATUS_FD, &pid, sizeof(pid)) == sizeof(pid)
+			&& waitpid(child, &status, 0) == child;
+		int32_t reported = (int32_t)status;
+		ok = ok && write(FORK_SERVER_STATUS_FD, &reported, sizeof(reported)) == sizeof(reported);
+	}
+	free(machine);
+#if JIT_SUPPORTED
+	if (function != NULL) jit_unload(&program);
+#endif
+	return ok;
+}
+
+#endif
+
+static uint64_t now_ns(void)
+{
+	struct timespec now;
+#if BENCH_SUPPORTED
+	clock_gettime(CLOCK_MONOTONIC, &now);
+#else
+	timespec_get(&now, TIME_UTC);
+#endif
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+typedef struct IrMetrics IrMetrics;
+struct IrMetrics
+{
+	size_t blocks;
+	size_t ops;
+	size_t loops;
+	size_t max_depth;
+	// calloc of every block and realloc of every growth of its ops.
+	size_t allocations;
+};
+
+static IrMetrics ir_metrics(Block* block)
+{
+	IrMetrics metrics = {0};
+	Blocks loops = {0};
+	while (1)
+	{
+		metrics.blocks++;
+		metrics.allocations++;
+		metrics.ops += block->ops.count;
+		for (size_t capacity = block->ops.capacity; capacity != 0; capacity /= 2)
+		{
+			metrics.allocations++;
+		}
+		if (block->exit != NULL)
+		{
+			metrics.loops++;
+			blocks_push(&loops, block);
+			if (loops.count > metrics.max_depth) metrics.max_depth = loops.count;
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			block = blocks_pop(&loops)->exit;
+		}
+		else block = block->next;
+	}
+	free(loops.items);
+	return metrics;
+}
+
+#define STATS_MAX_PHASES 8
+
+typedef struct StatsPhase StatsPhase;
+struct StatsPhase
+{
+	const char* name;
+	uint64_t start_ns;
+	uint64_t end_ns;
+};
+
+// Collected by --stats and --trace while compiling.
+typedef struct Stats Stats;
+struct Stats
+{
+	StatsPhase phases[STATS_MAX_PHASES];
+	size_t phase_count;
+	uint64_t origin_ns;
+	size_t commands; // Source commands other than `[` and `]`.
+	IrMetrics parsed;
+	IrMetrics optimized;
+	int cached; // The IR came from --ir-cache, parsed is unknown.
+	long output_bytes; // -1 if unknown.
+};
+
+static void stats_begin(Stats* stats, const char* name)
+{
+	if (stats == NULL) return;
+	ASSERT(stats->phase_count < STATS_MAX_PHASES);
+	stats->phases[stats->phase_count++] = (StatsPhase){ .name = name, .start_ns = now_ns() };
+}
+
+static void stats_end(Stats* stats)
+{
+	if (stats == NULL) return;
+	ASSERT(stats->phase_count > 0);
+	stats->phases[stats->phase_count - 1].end_ns = now_ns();
+}
+
+#if COUNTED_OUTPUT_SUPPORTED
+
+typedef struct CountedOutput CountedOutput;
+struct CountedOutput
+{
+	FILE* file;
+	long* bytes;
+};
+
+static ssize_t counted_output_write(void* cookie, const char* buffer, size_t size)
+{
+	CountedOutput* output = cookie;
+	size_t written = fwrite(buffer, 1, size, output->file);
+	*output->bytes += (long)written;
+	return (ssize_t)written;
+}
+
+static int counted_output_close(void* cookie)
+{
+	free(cookie);
+	return 0;
+}
+
+// Returns a stream that writes through to file and adds the bytes
+// that made it there to *bytes. Closing it leaves file open.
+static FILE* counted_output(FILE* file, long* bytes)
+{
+	CountedOutput* output = malloc(sizeof(CountedOutput));
+	if (output == NULL) crash_alloc_failed();
+	*output = (CountedOutput){ .file = file, .bytes = bytes };
+	FILE* stream = fopencookie(output, "w", (cookie_io_functions_t){ .write = counted_output_write, .close = counted_output_close });
+	if (stream == NULL) crash_alloc_failed();
+	return stream;
+}
+
+#endif
+
+static void print_ir_metrics(const char* name, IrMetrics metrics)
+{
+	fprintf(
+		stderr,
+		"stats: %s: %zu blocks, %zu ops, %zu loops, max depth %zu, %zu allocations\n",
+		name,
+		metrics.blocks,
+		metrics.ops,
+		metrics.loops,
+		metrics.max_depth,
+		metrics.allocations);
+}
+
+static void print_stats(Stats* stats, int optimized)
+{
+	for (size_t i = 0; i < stats->phase_count; i++)
+	{
+		StatsPhase phase = stats->phases[i];
+		fprintf(stderr, "stats: %s %.3f ms\n", phase.name, (double)(phase.end_ns - phase.start_ns) / 1e6);
+	}
+	if (stats->output_bytes >= 0) fprintf(stderr, "stats: wrote %ld bytes\n", stats->output_bytes);
+#if BENCH_SUPPORTED
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0) fprintf(stderr, "stats: peak rss %ld KiB\n", usage.ru_maxrss);
+#endif
+	if (stats->cached)
+	{
+		fprintf(stderr, "stats: IR loaded from cache\n");
+		print_ir_metrics("optimized", stats->optimized);
+		return;
+	}
+	fprintf(
+		stderr,
+		"stats: %zu commands merged into %zu ops (%.1f%% merged)\n",
+		stats->commands,
+		stats->parsed.ops,
+		(stats->commands == 0) ? 0.0 : 100.0 * (double)(stats->commands - stats->parsed.ops) / (double)stats->commands);
+	print_ir_metrics("parsed", stats->parsed);
+	if (optimized) print_ir_metrics("optimized", stats->optimized);
+}
+
+// Writes the phases as complete events of the Chrome trace event format.
+static int write_trace(Stats* stats, const char* path)
+{
+	FILE* file = fopen(path, "w");
+	if (file == NULL)
+	{
+		print_file_not_opened(path, "writing");
+		return 0;
+	}
+	int ok = fprintf(file, "{\"traceEvents\": [\n") >= 0;
+	for (size_t i = 0; i < stats->phase_count && ok; i++)
+	{
+		StatsPhase phase = stats->phases[i];
+		ok = fprintf(
+			file,
+			"  {\"name\": \"%s\", \"cat\": \"compile\", \"ph\": \"X\", \"pid\": 1, \"tid\": 1, "
+			"\"ts\": %.3f, \"dur\": %.3f}%s\n",
+			phase.name,
+			(double)(phase.start_ns - stats->origin_ns) / 1e3,
+			(double)(phase.end_ns - phase.start_ns) / 1e3,
+			(i + 1 == stats->phase_count) ? "" : ",") >= 0;
+	}
+	if (ok) ok = fprintf(file, "]}\n") >= 0;
+	if (fclose(file) != 0) ok = 0;
+	return ok;
+}
+
+#if BENCH_SUPPORTED
+
+// Measurements of one --bench run, sent from the child to the parent.
+typedef struct BenchSample BenchSample;
+struct BenchSample
+{
+	uint64_t wall_ns;
+	uint64_t user_ns;
+	uint64_t sys_ns;
+	uint64_t instructions;
+	uint64_t cycles;
+	int counted; // Whether instructions and cycles were counted.
+};
+
+// Returns -1 if hardware counters are not available.
+static int bench_open_counter(uint64_t config)
+{
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.type = PERF_TYPE_HARDWARE;
+	attr.size = sizeof(attr);
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+// Runs in a forked child with input on stdin and output discarded.
+static void bench_child(Block* block, void (*function)(Machine*), int result_fd)
+{
+	BenchSample sample = {0};
+	Machine* machine = calloc(1, sizeof(Machine));
+	if (machine == NULL) crash_alloc_failed();
+	machine->input = stdin;
+	machine->output = stdout;
+	int instructions = bench_open_counter(PERF_COUNT_HW_INSTRUCTIONS);
+	int cycles = bench_open_counter(PERF_COUNT_HW_CPU_CYCLES);
+	sample.counted = instructions >= 0 && cycles >= 0;
+	if (sample.counted)
+	{
+		ioctl(instructions, PERF_EVENT_IOC_ENABLE, 0);
+		ioctl(cycles, PERF_EVENT_IOC_ENABLE, 0);
+	}
+	uint64_t start = now_ns();
+	if (function != NULL) function(machine);
+	else interpret(machine, block);
+	fflush(machine->output);
+	sample.wall_ns = now_ns() - start;
+	if (sample.counted)
+	{
+		ioctl(instructions, PERF_EVENT_IOC_DISABLE, 0);
+		ioctl(cycles, PERF_EVENT_IOC_DISABLE, 0);
+		sample.counted =
+			read(instructions, &sample.instructions, sizeof(uint64_t)) == sizeof(uint64_t)
+			&& read(cycles, &sample.cycles, sizeof(uint64_t)) == sizeof(uint64_t);
+	}
+	if (write(result_fd, &sample, sizeof(sample)) != sizeof(sample)) _exit(1);
+	_exit(0);
+}
+
+static int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return (x < y) ? -1 : (x > y);
+}
+
+// Prints min, median and p95 (nearest rank) of a field of the samples.
+static void bench_print_stats(const char* name, BenchSample* samples, size_t count, size_t offset, int last)
+{
+	uint64_t* values = malloc(count * sizeof(uint64_t));
+	if (values == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < count; i++)
+	{
+		memcpy(&values[i], (char*)&samples[i] + offset, sizeof(uint64_t));
+	}
+	qsort(values, count, sizeof(uint64_t), compare_u64);
+	printf(
+		"  \"%s\": {\"min\": %" PRIu64 ", \"median\": %" PRIu64 ", \"p95\": %" PRIu64 "}%s\n",
+		name,
+		values[0],
+		values[(count + 1) / 2 - 1],
+		values[(count * 95 + 99) / 100 - 1],
+		last ? "" : ",");
+	free(values);
+}
+
+// Runs the program runs times, each in a fresh process reading input_path,
+// and prints timing statistics as JSON.
+static int bench(Block* block, const char* source_path, const char* input_path, size_t runs, int jit, int optimized)
+{
+	void (*function)(Machine*) = NULL;
+#if JIT_SUPPORTED
+	JitProgram program;
+	if (jit && jit_load(&program, block, NULL, NULL, 0)) function = program.function;
+#endif
+	BenchSample* samples = calloc(runs, sizeof(BenchSample));
+	if (samples == NULL) crash_alloc_failed();
+	int counted = 1;
+	int ok = 1;
+	fflush(stdout);
+	for (size_t i = 0; i < runs && ok; i++)
+	{
+		int fds[2];
+		if (pipe(fds) != 0)
+		{
+			ok = 0;
+			break;
+		}
+		pid_t child = fork();
+		if (child == 0)
+		{
+			close(fds[0]);
+			if (freopen(input_path, "rb", stdin) == NULL) _exit(1);
+			if (freopen("/dev/null", "wb", stdout) == NULL) _exit(1);
+			bench_child(block, function, fds[1]);
+		}
+		close(fds[1]);
+		int status = 0;
+		struct rusage usage;
+		if (child < 0
+			|| read(fds[0], &samples[i], sizeof(BenchSample)) != sizeof(BenchSample)
+			|| wait4(child, &status, 0, &usage) != child
+			|| !WIFEXITED(status)
+			|| WEXITSTATUS(status) != 0)
+		{
+			fprintf(stderr, "error: Run %zu of %s on %s failed.\n", i + 1, source_path, input_path);
+			ok = 0;
+		}
+		close(fds[0]);
+		samples[i].user_ns = (uint64_t)usage.ru_utime.tv_sec * 1000000000u + (uint64_t)usage.ru_utime.tv_usec * 1000u;
+		samples[i].sys_ns = (uint64_t)usage.ru_stime.tv_sec * 1000000000u + (uint64_t)usage.ru_stime.tv_usec * 1000u;
+		if (!samples[i].counted) counted = 0;
+	}
+#if JIT_SUPPORTED
+	if (function != NULL) jit_unload(&program);
+#endif
+	if (ok)
+	{
+		printf("{\n  \"program\": ");
+		print_json_string(stdout, source_path);
+		printf(",\n  \"input\": ");
+		print_json_string(stdout, input_path);
+		printf(
+			",\n"
+			"  \"runs\": %zu,\n"
+			"  \"mode\": \"%s\",\n"
+			"  \"optimized\": %s,\n",
+			runs,
+			(function != NULL) ? "jit" : "interpreter",
+			optimized ? "true" : "false");
+		bench_print_stats("wall_ns", samples, runs, offsetof(BenchSample, wall_ns), 0);
+		bench_print_stats("user_ns", samples, runs, offsetof(BenchSample, user_ns), 0);
+		bench_print_stats("sys_ns", samples, runs, offsetof(BenchSample, sys_ns), 0);
+		if (counted)
+		{
+			bench_print_stats("instructions", samples, runs, offsetof(BenchSample, instructions), 0);
+			bench_print_stats("cycles", samples, runs, offsetof(BenchSample, cycles), 1);
+		}
+		else printf("  \"instructions\": null,\n  \"cycles\": null\n");
+		printf("}\n");
+	}
+	free(samples);
+	return ok;
+}
+
+#endif
+
+static int compare_profile_records(const void* a, const void* b)
+{
+	const ProfileRecord* x = a;
+	const ProfileRecord* y = b;
+	if (x->count != y->count) return (x->count < y->count) ? 1 : -1;
+	if (x->line != y->line) return (x->line < y->line) ? -1 : 1;
+	if (x->column != y->column) return (x->column < y->column) ? -1 : 1;
+	return 0;
+}
+
+// Returns NULL if path can't be read or is not a profile.
+ProfileRecord* read_profile(const char* path, size_t* count)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL)
+	{
+		print_file_not_opened(path, "reading");
+		return NULL;
+	}
+	char magic[8];
+	uint64_t stored_count;
+	if (fread(magic, sizeof(magic), 1, f) != 1
+		|| memcmp(magic, PROFILE_MAGIC, sizeof(magic)) != 0
+		|| fread(&stored_count, sizeof(stored_count), 1, f) != 1
+		|| stored_count > SIZE_MAX / sizeof(ProfileRecord) - 1)
+	{
+		fprintf(stderr, "error: %s is not a profile.\n", path);
+		fclose(f);
+		return NULL;
+	}
+	*count = stored_count;
+	ProfileRecord* records = malloc((*count + 1) * sizeof(ProfileRecord));
+	if (records == NULL) crash_alloc_failed();
+	if (fread(records, sizeof(ProfileRecord), *count, f) != *count)
+	{
+		fprintf(stderr, "error: Profile %s is truncated.\n", path);
+		free(records);
+		fclose(f);
+		return NULL;
+	}
+	fclose(f);
+	return records;
+}
+
+int print_profile(const char* path)
+{
+	size_t count;
+	ProfileRecord* records = read_profile(path, &count);
+	if (records == NULL) return 1;
+	qsort(records, count, sizeof(ProfileRecord), compare_profile_records);
+	for (size_t i = 0; i < count; i++)
+	{
+		printf(
+			"%" PRIu32 ":%" PRIu32 " %s %" PRIu64 "\n",
+			records[i].line,
+			records[i].column,
+			(records[i].kind == PROFILE_KIND_LOOP) ? "loop" : "block",
+			records[i].count);
+	}
+	free(records);
+	return 0;
+}
+
+static int compare_profile_hashes(const void* a, const void* b)
+{
+	const ProfileRecord* x = a;
+	const ProfileRecord* y = b;
+	if (x->hash != y->hash) return (x->hash < y->hash) ? -1 : 1;
+	return 0;
+}
+
+// Finds the execution count of a loop in records sorted by hash.
+// Prefers the record at the same source position, otherwise takes the
+// largest count of loops with the same body. Returns 0 if there's none.
+static int profile_lookup(ProfileRecord* records, size_t count, Block* loop, uint64_t* executions)
+{
+	size_t low = 0;
+	size_t high = count;
+	while (low < high)
+	{
+		size_t middle = low + (high - low) / 2;
+		if (records[middle].hash < loop->hash) low = middle + 1;
+		else high = middle;
+	}
+	int found = 0;
+	for (size_t i = low; i < count && records[i].hash == loop->hash; i++)
+	{
+		if (records[i].kind != PROFILE_KIND_LOOP) continue;
+		if (records[i].line == loop->line && records[i].column == loop->column)
+		{
+			*executions = records[i].count;
+			return 1;
+		}
+		if (!found || records[i].count > *executions) *executions = records[i].count;
+		found = 1;
+	}
+	return found;
+}
+
+// Marks loops as hot or cold from the execution counts in a profile.
+// Returns 0 if the profile can't be read.
+int apply_profile(Block* block, const char* path, Remarks* remarks)
+{
+	size_t count;
+	ProfileRecord* records = read_profile(path, &count);
+	if (records == NULL) return 0;
+	qsort(records, count, sizeof(ProfileRecord), compare_profile_hashes);
+	uint64_t hottest = 0;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (records[i].kind == PROFILE_KIND_LOOP && records[i].count > hottest) hottest = records[i].count;
+	}
+
+	Blocks loops = {0};
+	while (1)
+	{
+		uint64_t executions;
+		if (block->exit != NULL)
+		{
+			int found = profile_lookup(records, count, block, &executions);
+			if (found)
+			{
+				if (executions == 0) block->heat = BLOCK_HEAT_COLD;
+				else if (executions >= PGO_HOT_MIN && executions >= hottest / PGO_HOT_FRACTION) block->heat = BLOCK_HEAT_HOT;
+			}
+			remark(
+				remarks,
+				"profile",
+				block->heat != BLOCK_HEAT_NORMAL,
+				block->line,
+				block->column,
+				block->exit->line,
+				block->exit->column,
+				!found ? "not in the profile" :
+				(block->heat == BLOCK_HEAT_HOT) ? "hot with %" PRIu64 " iterations, aligned and unrolled if innermost" :
+				(block->heat == BLOCK_HEAT_COLD) ? "never ran, moved out of line" :
+				"%" PRIu64 " iterations are not hot enough",
+				found ? executions : 0);
+			blocks_push(&loops, block);
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			block = blocks_pop(&loops)->exit;
+		}
+		else block = block->next;
+	}
+	free(loops.items);
+	free(records);
+	return 1;
+}
+
+// The optimized IR of a program, written by --ir-cache so that later compiles
+// of the same source skip parse() and optimize(). Blocks, ops, stream maps
+// and print runs are stored as arrays of the in-memory structs, with every
+// pointer replaced by the index of its target plus 1 (0 stays NULL). Loading
+// maps the file copy-on-write and relocates the pointers in place, so the
+// structs are used straight from the mapping without copying or allocating.
+// The layout is that of the compiler that wrote the file, so the header
+// records the struct sizes and IR_CACHE_VERSION, which changes whenever
+// the IR or the optimizer does.
+#define IR_CACHE_MAGIC "BBIR"
+#define IR_CACHE_VERSION 1
+
+typedef struct IrCacheHeader IrCacheHeader;
+struct IrCacheHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint32_t block_size;
+	uint32_t op_size;
+	uint32_t map_size;
+	uint32_t print_size;
+	uint64_t key;
+	uint64_t block_count;
+	uint64_t op_count;
+	uint64_t map_count;
+	uint64_t print_count;
+	uint64_t bytes_size;
+};
+
+// Hash of everything that decides the optimized IR.
+static uint64_t ir_cache_key(const char* src, int optimized)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (const char* c = src; *c != '\0'; c++)
+	{
+		hash = (hash ^ (uint8_t)*c) * PARSE_HASH_BASE;
+	}
+	return hash_mix(hash + (uint64_t)optimized * 2 + IR_CACHE_VERSION * 4);
+}
+
+typedef struct PointerIndex PointerIndex;
+struct PointerIndex
+{
+	const void* pointer;
+	uint64_t index;
+};
+
+typedef struct PointerIndices PointerIndices;
+struct PointerIndices
+{
+	size_t capacity;
+	size_t count;
+	PointerIndex* items;
+};
+
+static void pointer_indices_push(PointerIndices* indices, const void* pointer)
+{
+	if (indices->count == indices->capacity)
+	{
+		ASSERT(indices->capacity <= SIZE_MAX / sizeof(PointerIndex) / 2);
+		indices->capacity = (indices->capacity == 0) ? 1 : indices->capacity * 2;
+		indices->items = realloc(indices->items, indices->capacity * sizeof(PointerIndex));
+		if (indices->items == NULL) crash_alloc_failed();
+	}
+	indices->items[indices->count] = (PointerIndex){ .pointer = pointer, .index = indices->count };
+	indices->count++;
+}
+
+static int compare_pointer_indices(const void* a, const void* b)
+{
+	uintptr_t x = (uintptr_t)((const PointerIndex*)a)->pointer;
+	uintptr_t y = (uintptr_t)((const PointerIndex*)b)->pointer;
+	return (x > y) - (x < y);
+}
+
+// Index of pointer plus 1, or 0 for NULL. The indices must be sorted.
+static uintptr_t pointer_index(const PointerIndices* indices, const void* pointer)
+{
+	if (pointer == NULL) return 0;
+	PointerIndex key = { .pointer = pointer };
+	PointerIndex* found = bsearch(&key, indices->items, indices->count, sizeof(PointerIndex), compare_pointer_indices);
+	ASSERT(found != NULL);
+	return (uintptr_t)found->index + 1;
+}
+
+// Writes the IR reachable from root, root first. The original loops of stream
+// maps are not on the next/exit chains, they are reached through their op.
+static int write_ir_cache(Block* root, const char* path, uint64_t key)
+{
+	PointerIndices blocks = {0};
+	PointerIndices maps = {0};
+	PointerIndices prints = {0};
+	Blocks pending = {0};
+	uint64_t op_count = 0;
+	uint64_t bytes_size = 0;
+	blocks_push(&pending, root);
+	while (pending.count != 0)
+	{
+		Block* block = blocks_pop(&pending);
+		pointer_indices_push(&blocks, block);
+		op_count += block->ops.count;
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			Op* op = &block->ops.items[i];
+			if (op->tag == OP_TAG_MAP)
+			{
+				pointer_indices_push(&maps, op->as.map.map);
+				bytes_size += op->as.map.map->size;
+				blocks_push(&pending, op->as.map.map->loop);
+			}
+			else if (op->tag == OP_TAG_PRINT) pointer_indices_push(&prints, op->as.print.run);
+		}
+		if (block->exit != NULL) blocks_push(&pending, block->exit);
+		if (block->next != NULL) blocks_push(&pending, block->next);
+	}
+	free(pending.items);
+
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return 0;
+	IrCacheHeader header = {
+		.magic = IR_CACHE_MAGIC,
+		.version = IR_CACHE_VERSION,
+		.block_size = sizeof(Block),
+		.op_size = sizeof(Op),
+		.map_size = sizeof(StreamMap),
+		.print_size = sizeof(PrintRun),
+		.key = key,
+		.block_count = blocks.count,
+		.op_count = op_count,
+		.map_count = maps.count,
+		.print_count = prints.count,
+		.bytes_size = bytes_size,
+	};
+	int ok = fwrite(&header, sizeof(header), 1, file) == 1;
+	// The arrays are written in the order of the indices, which are sorted
+	// by pointer for lookups only after that.
+	Block** block_order = malloc((blocks.count + 1) * sizeof(Block*));
+	StreamMap** map_order = malloc((maps.count + 1) * sizeof(StreamMap*));
+	PrintRun** print_order = malloc((prints.count + 1) * sizeof(PrintRun*));
+	if (block_order == NULL || map_order == NULL || print_order == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < blocks.count; i++) block_order[i] = (Block*)blocks.items[i].pointer;
+	for (size_t i = 0; i < maps.count; i++) map_order[i] = (StreamMap*)maps.items[i].pointer;
+	for (size_t i = 0; i < prints.count; i++) print_order[i] = (PrintRun*)prints.items[i].pointer;
+	qsort(blocks.items, blocks.count, sizeof(PointerIndex), compare_pointer_indices);
+	qsort(maps.items, maps.count, sizeof(PointerIndex), compare_pointer_indices);
+	qsort(prints.items, prints.count, sizeof(PointerIndex), compare_pointer_indices);
+
+	uint64_t op_start = 0;
+	for (size_t i = 0; ok && i < blocks.count; i++)
+	{
+		Block* block = block_order[i];
+		Block stored;
+		memset(&stored, 0, sizeof(stored));
+		stored.next = (Block*)pointer_index(&blocks, block->next);
+		stored.exit = (Block*)pointer_index(&blocks, block->exit);
+		stored.ops.capacity = block->ops.count;
+		stored.ops.count = block->ops.count;
+		stored.ops.items = (Op*)(uintptr_t)((block->ops.count == 0) ? 0 : op_start + 1);
+		stored.line = block->line;
+		stored.column = block->column;
+		stored.hash = block->hash;
+		stored.heat = block->heat;
+		op_start += block->ops.count;
+		ok = fwrite(&stored, sizeof(stored), 1, file) == 1;
+	}
+	for (size_t i = 0; ok && i < blocks.count; i++)
+	{
+		Block* block = block_order[i];
+		for (size_t j = 0; ok && j < block->ops.count; j++)
+		{
+			Op* op = &block->ops.items[j];
+			Op stored;
+			memset(&stored, 0, sizeof(stored));
+			stored.tag = op->tag;
+			stored.line = op->line;
+			stored.column = op->column;
+			switch (op->tag)
+			{
+			case OP_TAG_INC: stored.as.inc = op->as.inc; break;
+			case OP_TAG_SHIFT: stored.as.shift = op->as.shift; break;
+			case OP_TAG_ECHO: stored.as.echo = op->as.echo; break;
+			case OP_TAG_MAP: stored.as.map.map = (StreamMap*)pointer_index(&maps, op->as.map.map); break;
+			case OP_TAG_PRINT: stored.as.print.run = (PrintRun*)pointer_index(&prints, op->as.print.run); break;
+			default: break;
+			}
+			ok = fwrite(&stored, sizeof(stored), 1, file) == 1;
+		}
+	}
+	uint64_t bytes_start = 0;
+	for (size_t i = 0; ok && i < maps.count; i++)
+	{
+		StreamMap stored = *map_order[i];
+		stored.bytes = (uint8_t*)(uintptr_t)((stored.size == 0) ? 0 : bytes_start + 1);
+		stored.loop = (Block*)pointer_index(&blocks, stored.loop);
+		bytes_start += stored.size;
+		ok = fwrite(&stored, sizeof(stored), 1, file) == 1;
+	}
+	for (size_t i = 0; ok && i < prints.count; i++)
+	{
+		ok = fwrite(print_order[i], sizeof(PrintRun), 1, file) == 1;
+	}
+	for (size_t i = 0; ok && i < maps.count; i++)
+	{
+		ok = fwrite(map_order[i]->bytes, 1, map_order[i]->size, file) == map_order[i]->size;
+	}
+	free(block_order);
+	free(map_order);
+	free(print_order);
+	free(blocks.items);
+	free(maps.items);
+	free(prints.items);
+	return fclose(file) == 0 && ok;
+}
+
+// Turns a stored index plus 1 back into a pointer into items,
+// fails if it is out of range.
+static int ir_cache_relocate(void** pointer, void* items, uint64_t count, size_t size)
+{
+	uintptr_t index = (uintptr_t)*pointer;
+	if (index > count) return 0;
+	*pointer = (index == 0) ? NULL : (uint8_t*)items + (index - 1) * size;
+	return 1;
+}
+
+// Returns the IR stored at path if it was written for key by this compiler,
+// NULL otherwise. The IR lives in the mapping for the rest of the process.
+static Block* load_ir_cache(const char* path, uint64_t key)
+{
+	FILE* file = fopen(path, "rb");
+	if (file == NULL) return NULL;
+	IrCacheHeader header;
+	if (fread(&header, sizeof(header), 1, file) != 1
+		|| memcmp(header.magic, IR_CACHE_MAGIC, sizeof(header.magic)) != 0
+		|| header.version != IR_CACHE_VERSION
+		|| header.block_size != sizeof(Block)
+		|| header.op_size != sizeof(Op)
+		|| header.map_size != sizeof(StreamMap)
+		|| header.print_size != sizeof(PrintRun)
+		|| header.key != key
+		|| header.block_count == 0
+		|| header.block_count > SIZE_MAX / sizeof(Block)
+		|| header.op_count > SIZE_MAX / sizeof(Op)
+		|| header.map_count > SIZE_MAX / sizeof(StreamMap)
+		|| header.print_count > SIZE_MAX / sizeof(PrintRun))
+	{
+		fclose(file);
+		return NULL;
+	}
+	uint64_t size = sizeof(header)
+		+ header.block_count * sizeof(Block)
+		+ header.op_count * sizeof(Op)
+		+ header.map_count * sizeof(StreamMap)
+		+ header.print_count * sizeof(PrintRun)
+		+ header.bytes_size;
+	if (fseek(file, 0, SEEK_END) != 0 || ftell(file) < 0 || (uint64_t)ftell(file) != size)
+	{
+		fclose(file);
+		return NULL;
+	}
+#if IR_CACHE_MMAP
+	uint8_t* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0);
+	fclose(file);
+	if (data == MAP_FAILED) return NULL;
+#else
+	uint8_t* data = malloc(size);
+	if (data == NULL) crash_alloc_failed();
+	int loaded = fseek(file, 0, SEEK_SET) == 0 && fread(data, 1, size, file) == size;
+	fclose(file);
+	if (!loaded)
+	{
+		free(data);
+		return NULL;
+	}
+#endif
+	Block* blocks = (Block*)(data + sizeof(header));
+	Op* ops = (Op*)(blocks + header.block_count);
+	StreamMap* maps = (StreamMap*)(ops + header.op_count);
+	PrintRun* prints = (PrintRun*)(maps + header.map_count);
+	uint8_t* bytes = (uint8_t*)(prints + header.print_count);
+	int ok = 1;
+	for (uint64_t i = 0; ok && i < header.block_count; i++)
+	{
+		Block* block = &blocks[i];
+		ok = ir_cache_relocate((void**)&block->next, blocks, header.block_count, sizeof(Block))
+			&& ir_cache_relocate((void**)&block->exit, blocks, header.block_count, sizeof(Block))
+			&& block->ops.count <= header.op_count
+			&& ir_cache_relocate((void**)&block->ops.items, ops, header.op_count - block->ops.count + 1, sizeof(Op));
+	}
+	for (uint64_t i = 0; ok && i < header.op_count; i++)
+	{
+		Op* op = &ops[i];
+		if (op->tag >= OP_TAG_COUNT) ok = 0;
+		else if (op->tag == OP_TAG_MAP) ok = ir_cache_relocate((void**)&op->as.map.map, maps, header.map_count, sizeof(StreamMap));
+		else if (op->tag == OP_TAG_PRINT) ok = ir_cache_relocate((void**)&op->as.print.run, prints, header.print_count, sizeof(PrintRun));
+	}
+	for (uint64_t i = 0; ok && i < header.print_count; i++)
+	{
+		ok = prints[i].count <= PRINT_MAX_COUNT;
+	}
+	for (uint64_t i = 0; ok && i < header.map_count; i++)
+	{
+		StreamMap* map = &maps[i];
+		ok = ir_cache_relocate((void**)&map->loop, blocks, header.block_count, sizeof(Block))
+			&& map->size <= header.bytes_size
+			&& ir_cache_relocate((void**)&map->bytes, bytes, header.bytes_size - map->size + 1, 1);
+		for (size_t value = 0; ok && value <= UINT8_MAX; value++)
+		{
+			ok = map->offsets[value] <= map->size && map->size - map->offsets[value] >= map->lengths[value];
+		}
+	}
+	if (!ok)
+	{
+#if IR_CACHE_MMAP
+		munmap(data, size);
+#else
+		free(data);
+#endif
+		return NULL;
+	}
+	return blocks;
+}
+
+// Prints and traces stats, unless stats is NULL.
+static int finish_stats(Stats* stats, const char* trace_path, int optimized)
+{
+	if (stats == NULL) return 1;
+	if (trace_path != NULL && !write_trace(stats, trace_path))
+	{
+		fprintf(stderr, "error: Failed to write trace to %s.\n", trace_path);
+		return 0;
+	}
+	print_stats(stats, optimized);
+	return 1;
+}
+
+char* read_entire_file(FILE* f)
+{
+	if (fseek(f, 0, SEEK_END) != 0) return NULL;
+	long fsize = ftell(f);
+	if (fsize == -1L) return NULL;
+	if (fseek(f, 0, SEEK_SET) != 0) return NULL;
+
+	char* string = malloc(fsize + 1);
+	if (string == NULL) crash_alloc_failed();
+	if (fread(string, fsize, 1, f) != 1) return NULL;
+
+	string[fsize] = 0;
+	return string;
+}
+
+// Reads, parses and unless optimized is 0 optimizes the program at path.
+// Returns NULL if the file can't be read.
+static Block* load_program(const char* path, int optimized)
+{
+	FILE* source = fopen(path, "rb");
+	if (source == NULL)
+	{
+		print_file_not_opened(path, "reading");
+		return NULL;
+	}
+	char* src = read_entire_file(source);
+	fclose(source);
+	if (src == NULL)
+	{
+		fprintf(stderr, "error: Unable to read from file %s: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	Block* block = parse(src, NULL);
+	free(src);
+	if (optimized) optimize(block, NULL);
+	return block;
+}
+
+#if RUNNER_SUPPORTED
+
+#define LANES_MAX 64
+#define LANES_DIVERGED UINT16_MAX
+
+// Up to LANES_MAX instances of one program run in lockstep by --lanes.
+// Cell k of every lane is contiguous, so increments and loop tests of lanes
+// that share a pointer are byte vector operations over a row of cells.
+// Lanes whose loop condition fails are masked off until the loop ends
+// for all of them.
+typedef struct Lanes Lanes;
+struct Lanes
+{
+	uint8_t cells[BF_MEMORY_SIZE][LANES_MAX];
+	uint16_t ptrs[LANES_MAX];
+	uint8_t alive[LANES_MAX]; // 0 for unused lanes and lanes out of fuel, 0xFF otherwise.
+	FILE* inputs[LANES_MAX];
+	FILE* outputs[LANES_MAX];
+	size_t count;
+	int fueled;
+	uint64_t fuel[LANES_MAX];
+	uint8_t out_of_fuel[LANES_MAX];
+};
+
+// Lanes that were active outside of each open loop.
+typedef struct LaneMasks LaneMasks;
+struct LaneMasks
+{
+	size_t capacity;
+	size_t count;
+	uint8_t (*items)[LANES_MAX];
+};
+
+static void lane_masks_push(LaneMasks* masks, const uint8_t* mask)
+{
+	if (masks->count == masks->capacity)
+	{
+		masks->capacity = (masks->capacity == 0) ? 16 : masks->capacity * 2;
+		masks->items = realloc(masks->items, masks->capacity * sizeof(masks->items[0]));
+		if (masks->items == NULL) crash_alloc_failed();
+	}
+	memcpy(masks->items[masks->count++], mask, LANES_MAX);
+}
+
+static int lanes_any(const uint8_t* mask)
+{
+	uint8_t any = 0;
+	for (size_t l = 0; l < LANES_MAX; l++)
+	{
+		any |= mask[l];
+	}
+	return any != 0;
+}
+
+// Returns the pointer of the lanes in mask if they all share it.
+static uint16_t lanes_uniform_ptr(const Lanes* lanes, const uint8_t* mask)
+{
+	uint16_t ptr = LANES_DIVERGED;
+	for (size_t l = 0; l < LANES_MAX; l++)
+	{
+		if (mask[l] == 0) continue;
+		if (ptr == LANES_DIVERGED) ptr = lanes->ptrs[l];
+		else if (ptr != lanes->ptrs[l]) return LANES_DIVERGED;
+	}
+	return ptr;
+}
+
+// Keeps the lanes of mask whose current cell is not zero.
+static void lanes_test(const Lanes* lanes, uint8_t* mask, uint16_t uniform)
+{
+	if (uniform != LANES_DIVERGED)
+	{
+		const uint8_t* row = lanes->cells[uniform];
+		for (size_t l = 0; l < LANES_MAX; l++)
+		{
+			mask[l] &= (row[l] != 0) ? 0xFF : 0;
+		}
+		return;
+	}
+	for (size_t l = 0; l < LANES_MAX; l++)
+	{
+		mask[l] &= (lanes->cells[lanes->ptrs[l]][l] != 0) ? 0xFF : 0;
+	}
+}
+
+static uint8_t lanes_read(FILE* input)
+{
+	int c = getc(input);
+	return (c == EOF) ? 0 : (uint8_t)c;
+}
+
+// Executes an op that does I/O on the current cell of one lane.
+static void lanes_stream_op(const Op* op, uint8_t* cell, FILE* input, FILE* output)
+{
+	switch (op->tag)
+	{
+	case OP_TAG_READ: {
+		*cell = lanes_read(input);
+	} break;
+	case OP_TAG_WRITE: {
+		putc(*cell, output);
+	} break;
+	case OP_TAG_ECHO: {
+		while (*cell != 0)
+		{
+			if (op->as.echo.write_first) putc(*cell, output);
+			*cell = lanes_read(input);
+			if (!op->as.echo.write_first) putc(*cell, output);
+		}
+	} break;
+	case OP_TAG_MAP: {
+		StreamMap* map = op->as.map.map;
+		while (*cell != 0)
+		{
+			fwrite(map->bytes + map->offsets[*cell], 1, map->lengths[*cell], output);
+			*cell = lanes_read(input);
+		}
+	} break;
+	case OP_TAG_PRINT: {
+		PrintRun* run = op->as.print.run;
+		for (size_t i = 0; i < run->count; i++)
+		{
+			putc((uint8_t)(*cell + run->deltas[i]), output);
+		}
+		*cell += run->inc;
+	} break;
+	default: {
+		ASSERT(0);
+	} break;
+	}
+}
+
+// Executes an op on the lanes in mask, returns the new shared pointer.
+static uint16_t lanes_op(Lanes* lanes, const Op* op, const uint8_t* mask, uint16_t uniform)
+{
+	switch (op->tag)
+	{
+	case OP_TAG_INC: {
+		uint8_t value = op->as.inc.value;
+		if (uniform != LANES_DIVERGED)
+		{
+			uint8_t* row = lanes->cells[uniform];
+			for (size_t l = 0; l < LANES_MAX; l++)
+			{
+				row[l] += value & mask[l];
+			}
+		}
+		else
+		{
+			for (size_t l = 0; l < LANES_MAX; l++)
+			{
+				lanes->cells[lanes->ptrs[l]][l] += value & mask[l];
+			}
+		}
+	} break;
+	case OP_TAG_SHIFT: {
+		uint16_t index = (uint16_t)op->as.shift.index;
+		for (size_t l = 0; l < LANES_MAX; l++)
+		{
+			uint16_t ptr = lanes->ptrs[l] + (mask[l] ? index : 0);
+			lanes->ptrs[l] = (ptr >= BF_MEMORY_SIZE) ? ptr - BF_MEMORY_SIZE : ptr;
+		}
+		if (uniform != LANES_DIVERGED) uniform = (uint16_t)((uniform + index) % BF_MEMORY_SIZE);
+	} break;
+	default: {
+		for (size_t l = 0; l < lanes->count; l++)
+		{
+			if (mask[l] == 0) continue;
+			lanes_stream_op(op, &lanes->cells[lanes->ptrs[l]][l], lanes->inputs[l], lanes->outputs[l]);
+		}
+	} break;
+	}
+	return uniform;
+}
+
+// Like interpret(), but for all alive lanes at once.
+static void lanes_run(Lanes* lanes, Block* block)
+{
+	Blocks loops = {0};
+	LaneMasks masks = {0};
+	uint8_t mask[LANES_MAX];
+	memcpy(mask, lanes->alive, LANES_MAX);
+	uint16_t uniform = lanes_uniform_ptr(lanes, mask);
+	int repeat = 0;
+	while (1)
+	{
+		if (block->exit != NULL && !repeat)
+		{
+			blocks_push(&loops, block);
+			lane_masks_push(&masks, mask);
+			lanes_test(lanes, mask, uniform);
+			if (!lanes_any(mask))
+			{
+				// No lane enters the loop.
+				loops.count--;
+				masks.count--;
+				for (size_t l = 0; l < LANES_MAX; l++)
+				{
+					mask[l] = masks.items[masks.count][l] & lanes->alive[l];
+				}
+				uniform = lanes_uniform_ptr(lanes, mask);
+				block = block->exit;
+				continue;
+			}
+			uniform = lanes_uniform_ptr(lanes, mask);
+		}
+		repeat = 0;
+		for (size_t i = 0; i < block->ops.count; i++)
+		{
+			uniform = lanes_op(lanes, &block->ops.items[i], mask, uniform);
+		}
+		if (block->next == NULL)
+		{
+			if (loops.count == 0) break;
+			Block* loop = loops.items[loops.count - 1];
+			for (size_t l = 0; l < lanes->count && lanes->fueled; l++)
+			{
+				if (mask[l] != 0 && lanes->fuel[l]-- == 0)
+				{
+					lanes->out_of_fuel[l] = 1;
+					lanes->alive[l] = 0;
+					mask[l] = 0;
+				}
+			}
+			lanes_test(lanes, mask, uniform);
+			if (lanes_any(mask))
+			{
+				uniform = lanes_uniform_ptr(lanes, mask);
+				block = loop;
+				repeat = 1;
+				continue;
+			}
+			// The loop is over for every lane, the ones that left earlier join again.
+			loops.count--;
+			masks.count--;
+			for (size_t l = 0; l < LANES_MAX; l++)
+			{
+				mask[l] = masks.items[masks.count][l] & lanes->alive[l];
+			}
+			uniform = lanes_uniform_ptr(lanes, mask);
+			block = loop->exit;
+		}
+		else block = block->next;
+	}
+	free(loops.items);
+	free(masks.items);
+}
+
+// A program of --runner, compiled once for all of its jobs.
+typedef struct RunnerProgram RunnerProgram;
+struct RunnerProgram
+{
+	const char* path;
+	Block* block;
+	void (*function)(Machine*); // NULL if interpreted.
+#if JIT_SUPPORTED
+	JitProgram jit;
+#endif
+};
+
+typedef struct RunnerJob RunnerJob;
+struct RunnerJob
+{
+	RunnerProgram* program;
+	const char* input_path;
+	const char* output_path;
+	const char* status; // "ok", "fuel" if it ran out of fuel, or "error".
+	uint64_t iterations; // Fuel used.
+	uint64_t ns;
+	size_t batch_next; // Next job run in lockstep with this one by --lanes, or SIZE_MAX.
+};
+
+typedef struct Runner Runner;
+struct Runner
+{
+	RunnerJob* jobs;
+	WorkQueue* queues;
+	size_t worker_count;
+	uint64_t fuel; // 0 if unlimited.
+	size_t lanes; // 0 unless jobs run in lockstep batches.
+};
+
+typedef struct RunnerWorker RunnerWorker;
+struct RunnerWorker
+{
+	Runner* runner;
+	size_t index;
+	pthread_t thread;
+};
+
+// Runs a job on the tape of the worker, which is reused for all of its jobs
+// and restored to the empty snapshot in between.
+static void runner_job(Runner* runner, RunnerJob* job, Machine* machine, const MachineSnapshot* empty)
+{
+	uint64_t start = now_ns();
+	machine_restore(machine, empty);
+	machine->fueled = runner->fuel != 0;
+	machine->fuel = runner->fuel;
+	machine->input = fopen(job->input_path, "rb");
+	machine->output = fopen(job->output_path, "wb");
+	int ok = machine->input != NULL && machine->output != NULL;
+	if (ok)
+	{
+		if (job->program->function != NULL) job->program->function(machine);
+		else interpret(machine, job->program->block);
+		ok = !ferror(machine->output);
+	}
+	if (machine->input != NULL) fclose(machine->input);
+	if (machine->output != NULL && fclose(machine->output) != 0) ok = 0;
+	job->status = !ok ? "error" : machine->out_of_fuel ? "fuel" : "ok";
+	job->iterations = machine->out_of_fuel ? runner->fuel : runner->fuel - machine->fuel;
+	job->ns = now_ns() - start;
+}
+
+// Runs the batch of jobs that starts at first, one in each lane.
+static void runner_batch(Runner* runner, size_t first, Lanes* lanes)
+{
+	uint64_t start = now_ns();
+	memset(lanes, 0, sizeof(Lanes));
+	lanes->fueled = runner->fuel != 0;
+	RunnerJob* jobs[LANES_MAX];
+	for (size_t job = first; job != SIZE_MAX; job = runner->jobs[job].batch_next)
+	{
+		size_t l = lanes->count++;
+		jobs[l] = &runner->jobs[job];
+		lanes->fuel[l] = runner->fuel;
+		lanes->inputs[l] = fopen(jobs[l]->input_path, "rb");
+		lanes->outputs[l] = fopen(jobs[l]->output_path, "wb");
+		if (lanes->inputs[l] != NULL && lanes->outputs[l] != NULL) lanes->alive[l] = 0xFF;
+	}
+	lanes_run(lanes, jobs[0]->program->block);
+	uint64_t ns = now_ns() - start;
+	for (size_t l = 0; l < lanes->count; l++)
+	{
+		RunnerJob* job = jobs[l];
+		int ok = lanes->alive[l] != 0 || lanes->out_of_fuel[l];
+		if (lanes->outputs[l] != NULL && ferror(lanes->outputs[l])) ok = 0;
+		if (lanes->inputs[l] != NULL) fclose(lanes->inputs[l]);
+		if (lanes->outputs[l] != NULL && fclose(lanes->outputs[l]) != 0) ok = 0;
+		job->status = !ok ? "error" : lanes->out_of_fuel[l] ? "fuel" : "ok";
+		job->iterations = lanes->out_of_fuel[l] ? runner->fuel : runner->fuel - lanes->fuel[l];
+		job->ns = ns;
+	}
+}
+
+static void* runner_worker(void* argument)
+{
+	RunnerWorker* worker = argument;
+	Runner* runner = worker->runner;
+	Machine* machine = NULL;
+	MachineSnapshot* empty = NULL;
+	Lanes* lanes = NULL;
+	if (runner->lanes != 0) lanes = malloc(sizeof(Lanes));
+	else
+	{
+		machine = calloc(1, sizeof(Machine));
+		empty = malloc(sizeof(MachineSnapshot));
+		if (machine != NULL && empty != NULL) machine_snapshot(machine, empty);
+	}
+	if ((machine == NULL || empty == NULL) && lanes == NULL) crash_alloc_failed();
+	size_t job;
+	while (work_take(runner->queues, runner->worker_count, worker->index, &job))
+	{
+		if (lanes != NULL) runner_batch(runner, job, lanes);
+		else runner_job(runner, &runner->jobs[job], machine, empty);
+	}
+	free(machine);
+	free(empty);
+	free(lanes);
+	return NULL;
+}
+
+// Runs every line `program input output` of the jobs file on worker_count
+// threads and prints a JSON line for every job, in the order of the file.
+// Unless lanes is 0, jobs of the same program run in lockstep batches of lanes.
+static int runner(const char* jobs_path, size_t worker_count, uint64_t fuel, size_t lanes, int jit, int optimized)
+{
+	FILE* file = fopen(jobs_path, "rb");
+	if (file == NULL)
+	{
+		print_file_not_opened(jobs_path, "reading");
+		return 0;
+	}
+	char* text = read_entire_file(file);
+	fclose(file);
+	if (text == NULL)
+	{
+		fprintf(stderr, "error: Unable to read from file %s: %s\n", jobs_path, strerror(errno));
+		return 0;
+	}
+
+	RunnerProgram* programs = NULL;
+	size_t program_count = 0;
+	RunnerJob* jobs = NULL;
+	size_t job_count = 0;
+	size_t line = 0;
+	for (char* c = text; *c != '\0';)
+	{
+		line++;
+		char* line_end = strchr(c, '\n');
+		char* next = (line_end != NULL) ? line_end + 1 : c + strlen(c);
+		if (line_end != NULL) *line_end = '\0';
+		char* comment = strchr(c, '#');
+		if (comment != NULL) *comment = '\0';
+		char* words[3];
+		size_t word_count = 0;
+		while (word_count <= 3)
+		{
+			while (*c == ' ' || *c == '\t' || *c == '\r') c++;
+			if (*c == '\0') break;
+			if (word_count < 3) words[word_count] = c;
+			word_count++;
+			while (*c != '\0' && *c != ' ' && *c != '\t' && *c != '\r') c++;
+			if (*c != '\0') *c++ = '\0';
+		}
+		c = next;
+		if (word_count == 0) continue;
+		if (word_count != 3)
+		{
+			fprintf(stderr, "error: Line %zu of %s is not `program input output`.\n", line, jobs_path);
+			return 0;
+		}
+		RunnerProgram* program = NULL;
+		for (size_t i = 0; i < program_count && program == NULL; i++)
+		{
+			if (strcmp(programs[i].path, words[0]) == 0) program = &programs[i];
+		}
+		if (program == NULL)
 		{
-			if (!emit_loop_head(block, layer, file, target)) goto error;
-			blocks_push(&loops, block);
-			layer++;
+			programs = realloc(programs, (program_count + 1) * sizeof(RunnerProgram));
+			if (programs == NULL) crash_alloc_failed();
+			program = &programs[program_count++];
+			*program = (RunnerProgram){ .path = words[0] };
 		}
+		jobs = realloc(jobs, (job_count + 1) * sizeof(RunnerJob));
+		if (jobs == NULL) crash_alloc_failed();
+		// Programs move while growing, so jobs hold their index until they are all known.
+		jobs[job_count++] = (RunnerJob){
+			.program = (RunnerProgram*)(uintptr_t)(program - programs),
+			.input_path = words[1],
+			.output_path = words[2],
+			.status = "error",
+		};
+	}
+	for (size_t i = 0; i < job_count; i++)
+	{
+		jobs[i].program = &programs[(uintptr_t)jobs[i].program];
+	}
 
-		for (size_t i = 0; i < block->ops.count; i++)
+	for (size_t i = 0; i < program_count; i++)
+	{
+		RunnerProgram* program = &programs[i];
+		program->block = load_program(program->path, optimized);
+		if (program->block == NULL) return 0;
+#if JIT_SUPPORTED
+		int options = JIT_TRACKED | ((fuel != 0) ? JIT_FUELED : 0);
+		if (jit && lanes == 0 && jit_load(&program->jit, program->block, NULL, NULL, options)) program->function = program->jit.function;
+#else
+		(void)jit;
+#endif
+	}
+
+	// Batches are filled in file order, a program has one open batch at a time.
+	size_t* heads = malloc((job_count + 1) * sizeof(size_t));
+	if (heads == NULL) crash_alloc_failed();
+	size_t head_count = 0;
+	size_t* open_tails = malloc((program_count + 1) * sizeof(size_t));
+	size_t* open_sizes = calloc(program_count + 1, sizeof(size_t));
+	if (open_tails == NULL || open_sizes == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < job_count; i++)
+	{
+		size_t program = (size_t)(jobs[i].program - programs);
+		jobs[i].batch_next = SIZE_MAX;
+		if (lanes != 0 && open_sizes[program] != 0 && open_sizes[program] < lanes)
 		{
-			Op op = block->ops.items[i];
-			switch (op.tag)
-			{
-			case OP_TAG_INC: {
-				if (!emit_op_inc(op.as.inc, layer, file, target)) goto error;
-			} break;
-			case OP_TAG_SHIFT: {
-				if (!emit_op_shift(op.as.shift, layer, file, target)) goto error;
-			} break;
-			case OP_TAG_READ: {
-				if (!emit_op_read(file, layer, target)) goto error;
-			} break;
-			case OP_TAG_WRITE: {
-				if (!emit_op_write(file, layer, target)) goto error;
-			} break;
-			default: {
-				ASSERT(0);
-			} break;
-			}
+			jobs[open_tails[program]].batch_next = i;
 		}
-		if (block->next == NULL)
+		else
 		{
-			if (loops.count == 0) break;
-			block = blocks_pop(&loops);
-			if (!emit_loop_tail(block, layer, file, target)) goto error;
-			block = block->exit;
-			layer--;
+			heads[head_count++] = i;
+			open_sizes[program] = 0;
 		}
-		else block = block->next;
+		open_tails[program] = i;
+		open_sizes[program]++;
 	}
-	if (!emit_file_tail(file, target)) goto error;
+	free(open_tails);
+	free(open_sizes);
 
-	ASSERT(layer == 0);
-	free(loops.items);
-	return 1;
-error:
-	free(loops.items);
-	return 0;
+	// Batches are dealt round robin, workers that run out steal the rest.
+	if (worker_count > head_count) worker_count = (head_count == 0) ? 1 : head_count;
+	Runner state = { .jobs = jobs, .worker_count = worker_count, .fuel = fuel, .lanes = lanes };
+	state.queues = work_queues_create(heads, head_count, worker_count);
+	RunnerWorker* workers = calloc(worker_count, sizeof(RunnerWorker));
+	if (workers == NULL) crash_alloc_failed();
+	int ok = 1;
+	size_t started = 0;
+	for (size_t i = 0; i < worker_count; i++)
+	{
+		workers[i] = (RunnerWorker){ .runner = &state, .index = i };
+		if (pthread_create(&workers[i].thread, NULL, runner_worker, &workers[i]) != 0) break;
+		started++;
+	}
+	// Jobs of workers that failed to start are stolen by the others.
+	if (started == 0) runner_worker(&workers[0]);
+	for (size_t i = 0; i < started; i++)
+	{
+		pthread_join(workers[i].thread, NULL);
+	}
+
+	for (size_t i = 0; i < job_count; i++)
+	{
+		RunnerJob* job = &jobs[i];
+		if (strcmp(job->status, "error") == 0) ok = 0;
+		printf("{\"job\": %zu, \"program\": ", i);
+		print_json_string(stdout, job->program->path);
+		printf(", \"input\": ");
+		print_json_string(stdout, job->input_path);
+		printf(", \"output\": ");
+		print_json_string(stdout, job->output_path);
+		printf(", \"status\": \"%s\", \"mode\": \"%s\", \"iterations\": ", job->status, (lanes != 0) ? "lanes" : (job->program->function != NULL) ? "jit" : "interpreter");
+		if (fuel != 0) printf("%" PRIu64, job->iterations);
+		else printf("null");
+		printf(", \"ns\": %" PRIu64 "}\n", job->ns);
+	}
+
+	work_queues_destroy(state.queues, worker_count);
+#if JIT_SUPPORTED
+	for (size_t i = 0; i < program_count; i++)
+	{
+		if (programs[i].function != NULL) jit_unload(&programs[i].jit);
+	}
+#endif
+	free(heads);
+	free(workers);
+	free(jobs);
+	free(programs);
+	free(text);
+	return ok;
 }
 
-void print_usage(const char* name)
+#endif
+
+#if PIPELINE_SUPPORTED
+
+#define RING_SIZE (1 << 16)
+#define RING_SPINS 64
+#define PIPELINE_BUFFER_SIZE (1 << 12)
+
+// Single producer, single consumer byte queue from the `.` of one --pipeline
+// stage to the `,` of the next. Stages only take the lock to sleep when the
+// ring is full or empty, stdio buffers batch the bytes in between.
+typedef struct Ring Ring;
+struct Ring
 {
-	fprintf(
-		stderr,
-		"Usage: %s <input>\n"
-		"input - path to input file.\n"
-		"flags:\n"
-		"-h - prints this message.\n"
-		"-o filename - sepcify path to output file.\n"
-		"              If output path is not specified,\n"
-		"              program will write to stdout.\n"
-		"--help - prints this message.\n"
-		"--libc - set target to libc (default).\n"
-		"--linux - set target to linux.\n"
-		"--brain - generates brainf*ck insted of assembly.\n",
-		name);
+	_Atomic size_t head; // Bytes read so far.
+	_Atomic size_t tail; // Bytes written so far.
+	_Atomic int waiting; // Sides sleeping on progress.
+	_Atomic int writer_closed;
+	_Atomic int reader_closed;
+	pthread_mutex_t lock;
+	pthread_cond_t progress;
+	uint8_t bytes[RING_SIZE];
+};
+
+static int ring_readable(Ring* ring)
+{
+	return atomic_load(&ring->tail) != atomic_load(&ring->head) || atomic_load(&ring->writer_closed);
 }
 
-void print_file_not_opened(const char* path, const char* purpose)
+static int ring_writable(Ring* ring)
 {
-	fprintf(
-		stderr,
-		"error: Failed to open %s for %s: %s\n",
-		path,
-		purpose,
-		strerror(errno));
+	return atomic_load(&ring->tail) - atomic_load(&ring->head) < RING_SIZE || atomic_load(&ring->reader_closed);
 }
 
-char* read_entire_file(FILE* f)
+static void ring_wait(Ring* ring, int (*ready)(Ring*))
 {
-	if (fseek(f, 0, SEEK_END) != 0) return NULL;
-	long fsize = ftell(f);
-	if (fsize == -1L) return NULL;
-	if (fseek(f, 0, SEEK_SET) != 0) return NULL;
+	for (size_t i = 0; i < RING_SPINS; i++)
+	{
+		if (ready(ring)) return;
+	}
+	pthread_mutex_lock(&ring->lock);
+	// The other side checks waiting after every update, so it either sees
+	// this side counted or the check below sees its update.
+	atomic_fetch_add(&ring->waiting, 1);
+	while (!ready(ring)) pthread_cond_wait(&ring->progress, &ring->lock);
+	atomic_fetch_sub(&ring->waiting, 1);
+	pthread_mutex_unlock(&ring->lock);
+}
 
-	char* string = malloc(fsize + 1);
-	if (string == NULL) crash_alloc_failed();
-	if (fread(string, fsize, 1, f) != 1) return NULL;
+static void ring_notify(Ring* ring)
+{
+	if (!atomic_load(&ring->waiting)) return;
+	pthread_mutex_lock(&ring->lock);
+	pthread_cond_broadcast(&ring->progress);
+	pthread_mutex_unlock(&ring->lock);
+}
 
-	string[fsize] = 0;
-	return string;
+static ssize_t ring_read(void* cookie, char* buffer, size_t size)
+{
+	Ring* ring = cookie;
+	ring_wait(ring, ring_readable);
+	size_t head = atomic_load(&ring->head);
+	size_t count = atomic_load(&ring->tail) - head;
+	if (count > size) count = size;
+	size_t start = head % RING_SIZE;
+	size_t first = (count < RING_SIZE - start) ? count : RING_SIZE - start;
+	memcpy(buffer, ring->bytes + start, first);
+	memcpy(buffer + first, ring->bytes, count - first);
+	atomic_store(&ring->head, head + count);
+	ring_notify(ring);
+	return (ssize_t)count;
+}
+
+static ssize_t ring_write(void* cookie, const char* buffer, size_t size)
+{
+	Ring* ring = cookie;
+	size_t written = 0;
+	while (written < size)
+	{
+		ring_wait(ring, ring_writable);
+		// Output nobody reads any more is dropped, like writes to a closed pipe.
+		if (atomic_load(&ring->reader_closed)) break;
+		size_t tail = atomic_load(&ring->tail);
+		size_t count = RING_SIZE - (tail - atomic_load(&ring->head));
+		if (count > size - written) count = size - written;
+		size_t start = tail % RING_SIZE;
+		size_t first = (count < RING_SIZE - start) ? count : RING_SIZE - start;
+		memcpy(ring->bytes + start, buffer + written, first);
+		memcpy(ring->bytes, buffer + written + first, count - first);
+		atomic_store(&ring->tail, tail + count);
+		ring_notify(ring);
+		written += count;
+	}
+	return (ssize_t)size;
+}
+
+static int ring_close_reader(void* cookie)
+{
+	Ring* ring = cookie;
+	atomic_store(&ring->reader_closed, 1);
+	ring_notify(ring);
+	return 0;
+}
+
+static int ring_close_writer(void* cookie)
+{
+	Ring* ring = cookie;
+	atomic_store(&ring->writer_closed, 1);
+	ring_notify(ring);
+	return 0;
+}
+
+typedef struct PipelineStage PipelineStage;
+struct PipelineStage
+{
+	Block* block;
+	int jit;
+	FILE* input;
+	FILE* output;
+	int closes_input;
+	int closes_output;
+	pthread_t thread;
+};
+
+static void* pipeline_stage(void* argument)
+{
+	PipelineStage* stage = argument;
+	Machine* machine = calloc(1, sizeof(Machine));
+	if (machine == NULL) crash_alloc_failed();
+	// Every stream belongs to a single stage, so stdio doesn't have to lock.
+	__fsetlocking(stage->input, FSETLOCKING_BYCALLER);
+	__fsetlocking(stage->output, FSETLOCKING_BYCALLER);
+	machine->input = stage->input;
+	machine->output = stage->output;
+	run_until(machine, stage->block, NULL, stage->jit, NULL);
+	// Closing the rings lets the next stage see EOF and the previous one stop.
+	if (stage->closes_output) fclose(stage->output);
+	else fflush(stage->output);
+	if (stage->closes_input) fclose(stage->input);
+	free(machine);
+	return NULL;
+}
+
+// Runs the programs like `a | b | c` with the first reading input and the last
+// writing output, each on its own thread and connected by rings.
+static int pipeline_run(Block** blocks, size_t count, FILE* input, FILE* output, int jit)
+{
+	Ring* rings = calloc(count, sizeof(Ring));
+	PipelineStage* stages = calloc(count, sizeof(PipelineStage));
+	if (rings == NULL || stages == NULL) crash_alloc_failed();
+	for (size_t i = 0; i < count; i++)
+	{
+		stages[i] = (PipelineStage){ .block = blocks[i], .jit = jit, .input = input, .output = output };
+	}
+	for (size_t i = 0; i + 1 < count; i++)
+	{
+		Ring* ring = &rings[i];
+		pthread_mutex_init(&ring->lock, NULL);
+		pthread_cond_init(&ring->progress, NULL);
+		stages[i].output = fopencookie(ring, "w", (cookie_io_functions_t){ .write = ring_write, .close = ring_close_writer });
+		stages[i + 1].input = fopencookie(ring, "r", (cookie_io_functions_t){ .read = ring_read, .close = ring_close_reader });
+		if (stages[i].output == NULL || stages[i + 1].input == NULL) crash_alloc_failed();
+		setvbuf(stages[i].output, NULL, _IOFBF, PIPELINE_BUFFER_SIZE);
+		setvbuf(stages[i + 1].input, NULL, _IOFBF, PIPELINE_BUFFER_SIZE);
+		stages[i].closes_output = 1;
+		stages[i + 1].closes_input = 1;
+	}
+	int ok = 1;
+	for (size_t i = 0; i < count; i++)
+	{
+		if (pthread_create(&stages[i].thread, NULL, pipeline_stage, &stages[i]) != 0)
+		{
+			// Stages that can't start would leave their neighbours waiting forever.
+			fprintf(stderr, "error: Failed to start a --pipeline stage.\n");
+			exit(1);
+		}
+	}
+	for (size_t i = 0; i < count; i++)
+	{
+		pthread_join(stages[i].thread, NULL);
+	}
+	if (ferror(output)) ok = 0;
+	for (size_t i = 0; i + 1 < count; i++)
+	{
+		pthread_mutex_destroy(&rings[i].lock);
+		pthread_cond_destroy(&rings[i].progress);
+	}
+	free(stages);
+	free(rings);
+	return ok;
 }
 
+#endif
+
 int main(int argc, char* argv[]) 
 {
 	const char* program_path = (argc >= 1) ? argv[0] : "<brainbrain-path>";
@@ -645,6 +5990,36 @@ int main(int argc, char* argv[])
 	Target target = TARGET_NOT_SELECTED;
 	const char* input_path = NULL;
 	const char* output_path = NULL;
+	int optimize_loops = 1;
+	const char* profile_path = NULL;
+	const char* use_profile_path = NULL;
+	int debug_info = 0;
+	int run_program = 0;
+	int jit = 1;
+	int perf_map = 0;
+	const char* heatmap_path = NULL;
+	int benchmark = 0;
+	int print_statistics = 0;
+	const char* remarks_path = NULL;
+	const char* trace_path = NULL;
+	const char* bench_input_path = "/dev/null";
+	size_t bench_runs = 10;
+	const char* ir_cache_path = NULL;
+	const char* embed_name = NULL;
+	const char* header_path = NULL;
+	int shared = 0;
+	size_t part_count = 1;
+	const char* jobs_path = NULL;
+	size_t threads = 0;
+	uint64_t fuel = 0;
+	size_t lanes = 0;
+	int serve_forks = 0;
+	int parallel = 0;
+	int pipeline = 0;
+	size_t compile_threads = 1;
+	const char** stage_paths = calloc(argc, sizeof(char*));
+	if (stage_paths == NULL) crash_alloc_failed();
+	size_t stage_count = 0;
 
 	for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0)
@@ -662,11 +6037,174 @@ int main(int argc, char* argv[])
 			if (target != TARGET_NOT_SELECTED) crash_multiple_targets();
 			target = TARGET_NASM_LINUX;
 		}
+		else if (strcmp(argv[i], "--bytecode") == 0)
+		{
+			if (target != TARGET_NOT_SELECTED) crash_multiple_targets();
+			target = TARGET_BYTECODE;
+		}
+		else if (strncmp(argv[i], "--embed=", 8) == 0)
+		{
+			if (target != TARGET_NOT_SELECTED) crash_multiple_targets();
+			target = TARGET_NASM_EMBED;
+			embed_name = argv[i] + 8;
+			if (*embed_name == '\0' || (*embed_name >= '0' && *embed_name <= '9')) crash_bad_embed_name();
+			for (const char* c = embed_name; *c != '\0'; c++)
+			{
+				if (*c != '_' && !(*c >= 'a' && *c <= 'z') && !(*c >= 'A' && *c <= 'Z') && !(*c >= '0' && *c <= '9')) crash_bad_embed_name();
+			}
+		}
+		else if (strcmp(argv[i], "--shared") == 0)
+		{
+			shared = 1;
+		}
+		else if (strncmp(argv[i], "--split=", 8) == 0)
+		{
+			char* end;
+			unsigned long long value = strtoull(argv[i] + 8, &end, 10);
+			if (argv[i][8] == '\0' || *end != '\0' || value == 0) crash_bad_split_flag();
+			part_count = (size_t)value;
+		}
+		else if (strncmp(argv[i], "--header=", 9) == 0)
+		{
+			header_path = argv[i] + 9;
+		}
 		else if (strcmp(argv[i], "--libc") == 0)
 		{
 			if (target != TARGET_NOT_SELECTED) crash_multiple_targets();
 			target = TARGET_NASM_LIBC;
 		}
+		else if (strcmp(argv[i], "--run") == 0)
+		{
+			run_program = 1;
+		}
+		else if (strcmp(argv[i], "--interpret") == 0)
+		{
+			run_program = 1;
+			jit = 0;
+		}
+		else if (strcmp(argv[i], "--pipeline") == 0)
+		{
+			pipeline = 1;
+		}
+		else if (strcmp(argv[i], "--parallel") == 0)
+		{
+			run_program = 1;
+			parallel = 1;
+		}
+		else if (strcmp(argv[i], "--fork-server") == 0)
+		{
+			run_program = 1;
+			serve_forks = 1;
+		}
+		else if (strncmp(argv[i], "--heatmap=", 10) == 0)
+		{
+			run_program = 1;
+			heatmap_path = argv[i] + 10;
+		}
+		else if (strcmp(argv[i], "--remarks") == 0)
+		{
+			remarks_path = "-";
+		}
+		else if (strncmp(argv[i], "--remarks=", 10) == 0)
+		{
+			remarks_path = argv[i] + 10;
+		}
+		else if (strcmp(argv[i], "--stats") == 0)
+		{
+			print_statistics = 1;
+		}
+		else if (strncmp(argv[i], "--trace=", 8) == 0)
+		{
+			trace_path = argv[i] + 8;
+		}
+		else if (strcmp(argv[i], "--bench") == 0)
+		{
+			benchmark = 1;
+		}
+		else if (strcmp(argv[i], "--input") == 0)
+		{
+			if (i + 1 >= argc) crash_bad_bench_flag(argv[i]);
+			i++;
+			bench_input_path = argv[i];
+		}
+		else if (strcmp(argv[i], "--runs") == 0)
+		{
+			if (i + 1 >= argc) crash_bad_bench_flag(argv[i]);
+			i++;
+			char* end;
+			unsigned long long runs = strtoull(argv[i], &end, 10);
+			if (*end != '\0' || runs == 0) crash_bad_bench_flag("--runs");
+			bench_runs = (size_t)runs;
+		}
+		else if (strcmp(argv[i], "--runner") == 0)
+		{
+			if (i + 1 >= argc) crash_bad_bench_flag(argv[i]);
+			i++;
+			jobs_path = argv[i];
+		}
+		else if (strcmp(argv[i], "--threads") == 0 || strcmp(argv[i], "--fuel") == 0 || strcmp(argv[i], "--lanes") == 0)
+		{
+			if (i + 1 >= argc) crash_bad_runner_flag(argv[i]);
+			char* end;
+			unsigned long long value = strtoull(argv[i + 1], &end, 10);
+			if (*end != '\0' || value == 0) crash_bad_runner_flag(argv[i]);
+			if (strcmp(argv[i], "--threads") == 0) threads = (size_t)value;
+			else if (strcmp(argv[i], "--fuel") == 0) fuel = (uint64_t)value;
+			else
+			{
+#if RUNNER_SUPPORTED
+				if (value > LANES_MAX) crash_too_many_lanes();
+#endif
+				lanes = (size_t)value;
+			}
+			i++;
+		}
+		else if (strcmp(argv[i], "--perf-map") == 0)
+		{
+			perf_map = 1;
+		}
+		else if (strcmp(argv[i], "-g") == 0)
+		{
+			debug_info = 1;
+		}
+		else if (strcmp(argv[i], "-O0") == 0)
+		{
+			optimize_loops = 0;
+		}
+		else if (strncmp(argv[i], "-j", 2) == 0)
+		{
+			const char* count = argv[i] + 2;
+			if (*count == '\0')
+			{
+				if (i + 1 >= argc) crash_bad_runner_flag("-j");
+				count = argv[++i];
+			}
+			char* end;
+			unsigned long long value = strtoull(count, &end, 10);
+			if (*end != '\0' || value == 0) crash_bad_runner_flag("-j");
+			compile_threads = (size_t)value;
+		}
+		else if (strcmp(argv[i], "--profile") == 0)
+		{
+			profile_path = PROFILE_DEFAULT_PATH;
+		}
+		else if (strncmp(argv[i], "--profile=", 10) == 0)
+		{
+			profile_path = argv[i] + 10;
+		}
+		else if (strncmp(argv[i], "--ir-cache=", 11) == 0)
+		{
+			ir_cache_path = argv[i] + 11;
+		}
+		else if (strncmp(argv[i], "--use-profile=", 14) == 0)
+		{
+			use_profile_path = argv[i] + 14;
+		}
+		else if (strcmp(argv[i], "--print-profile") == 0)
+		{
+			if (i + 1 >= argc) crash_bad_print_profile_flag();
+			return print_profile(argv[i + 1]);
+		}
 		else if (strcmp(argv[i], "-o") == 0)
 		{
 			if (output_path != NULL) crash_multiple_output_files();
@@ -676,13 +6214,71 @@ int main(int argc, char* argv[])
 		}
 		else
 		{
-			if (input_path != NULL) crash_multiple_input_files();
-			input_path = argv[i];
+			stage_paths[stage_count++] = argv[i];
 		}
     }
+	if (pipeline)
+	{
+#if PIPELINE_SUPPORTED
+		if (stage_count == 0) crash_pipeline_too_short();
+		Block** blocks = malloc(stage_count * sizeof(Block*));
+		if (blocks == NULL) crash_alloc_failed();
+		for (size_t i = 0; i < stage_count; i++)
+		{
+			blocks[i] = load_program(stage_paths[i], optimize_loops);
+			if (blocks[i] == NULL) return 1;
+		}
+		return pipeline_run(blocks, stage_count, stdin, stdout, jit) ? 0 : 1;
+#else
+		crash_pipeline_not_supported();
+#endif
+	}
+	if (stage_count > 1) crash_multiple_input_files();
+	if (stage_count == 1) input_path = stage_paths[0];
+	free(stage_paths);
+#if RUNNER_SUPPORTED
+	if (threads == 0)
+	{
+		long processors = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (processors > 0) ? (size_t)processors : 1;
+	}
+#endif
+	if (jobs_path != NULL)
+	{
+#if RUNNER_SUPPORTED
+		return runner(jobs_path, threads, fuel, lanes, jit, optimize_loops) ? 0 : 1;
+#else
+		crash_runner_not_supported();
+#endif
+	}
 	if (target == TARGET_NOT_SELECTED) target = TARGET_NASM_LIBC;
 	if (input_path == NULL) crash_no_input_files();
+	int assembly = target == TARGET_NASM_LIBC || target == TARGET_NASM_LINUX || target == TARGET_NASM_EMBED;
+	if (profile_path != NULL && !assembly) crash_profile_needs_native_target();
+	if (profile_path != NULL && target == TARGET_NASM_EMBED) crash_profile_needs_program();
+	if (part_count > 1 && (target == TARGET_NASM_EMBED || !assembly || output_path == NULL || run_program || benchmark)) crash_split_needs_program();
+	if (debug_info && !assembly) crash_debug_info_needs_native_target();
+	if (header_path != NULL && target != TARGET_NASM_EMBED) crash_header_needs_embed();
+	if (shared && target != TARGET_NASM_EMBED) crash_shared_needs_embed();
+	if ((run_program || benchmark) && (output_path != NULL || profile_path != NULL)) crash_run_with_output();
+	if (serve_forks && heatmap_path != NULL) crash_fork_server_with_heatmap();
+
+	Remarks remarks = { .file = stderr, .source_path = input_path };
+	Remarks* remarks_or_null = NULL;
+	if (remarks_path != NULL)
+	{
+		if (strcmp(remarks_path, "-") != 0) remarks.file = fopen(remarks_path, "w");
+		if (remarks.file == NULL)
+		{
+			print_file_not_opened(remarks_path, "writing");
+			return 1;
+		}
+		remarks_or_null = &remarks;
+	}
+	Stats statistics = { .origin_ns = now_ns(), .output_bytes = -1 };
+	Stats* stats = (print_statistics || trace_path != NULL) ? &statistics : NULL;
 
+	stats_begin(stats, "read");
 	FILE* input = fopen(input_path, "rb");
 	if (input == NULL)
 	{
@@ -695,27 +6291,171 @@ int main(int argc, char* argv[])
 		fprintf(stderr, "error: Uable to read from file %s: %s", input_path, strerror(errno));
 		return 1;
 	}
-	Block* flie = parse(src);
+	stats_end(stats);
+	if (stats != NULL)
+	{
+		for (const char* c = src; *c != '\0'; c++)
+		{
+			if (strchr("+-<>.,", *c) != NULL) stats->commands++;
+		}
+	}
+	Block* flie = NULL;
+	uint64_t ir_key = 0;
+	if (ir_cache_path != NULL)
+	{
+		stats_begin(stats, "load");
+		ir_key = ir_cache_key(src, optimize_loops);
+		flie = load_ir_cache(ir_cache_path, ir_key);
+		stats_end(stats);
+		if (stats != NULL && flie != NULL)
+		{
+			stats->cached = 1;
+			stats->optimized = ir_metrics(flie);
+		}
+	}
+	if (flie == NULL)
+	{
+		stats_begin(stats, "parse");
+		flie = parse(src, remarks_or_null);
+		stats_end(stats);
+		if (stats != NULL) stats->parsed = ir_metrics(flie);
+		if (optimize_loops)
+		{
+			stats_begin(stats, "optimize");
+			optimize_parallel(flie, remarks_or_null, compile_threads);
+			stats_end(stats);
+			if (stats != NULL) stats->optimized = ir_metrics(flie);
+		}
+		if (ir_cache_path != NULL && !write_ir_cache(flie, ir_cache_path, ir_key))
+		{
+			fprintf(stderr, "warning: Failed to write IR cache to %s.\n", ir_cache_path);
+		}
+	}
 	free(src);
+	// Heat only matters to codegen, so profiles apply to cached IR as well.
+	if (use_profile_path != NULL && !apply_profile(flie, use_profile_path, remarks_or_null)) return 1;
 	fclose(input);
+	if (benchmark)
+	{
+#if BENCH_SUPPORTED
+		return bench(flie, input_path, bench_input_path, bench_runs, jit, optimize_loops) ? 0 : 1;
+#else
+		crash_bench_not_supported();
+#endif
+	}
+	if (serve_forks)
+	{
+#if FORK_SERVER_SUPPORTED
+		return fork_server(flie, jit) ? 0 : 1;
+#else
+		crash_fork_server_not_supported();
+#endif
+	}
+	if (run_program)
+	{
+		Heatmap* heatmap = NULL;
+		if (heatmap_path != NULL)
+		{
+			heatmap = calloc(1, sizeof(Heatmap));
+			if (heatmap == NULL) crash_alloc_failed();
+			heatmap->file = fopen(heatmap_path, "w");
+			if (heatmap->file == NULL)
+			{
+				print_file_not_opened(heatmap_path, "writing");
+				return 1;
+			}
+			fprintf(heatmap->file, "window,cell,reads,writes,visits\n");
+		}
+		stats_begin(stats, "run");
+		run(flie, jit, perf_map ? input_path : NULL, heatmap, parallel ? threads : 1);
+		stats_end(stats);
+		if (heatmap != NULL)
+		{
+			fclose(heatmap->file);
+			free(heatmap);
+		}
+		return finish_stats(stats, trace_path, optimize_loops) ? 0 : 1;
+	}
 
-	FILE* output = stdout;
+	FILE** outputs = malloc(part_count * sizeof(FILE*));
+	if (outputs == NULL) crash_alloc_failed();
+	outputs[0] = stdout;
 	if (output_path == NULL) output_path = "stdout";
-	else 
+	else
 	{
-		output = fopen(output_path, "wb");
-		if (output == NULL)
+		for (size_t i = 0; i < part_count; i++)
 		{
-			print_file_not_opened(output_path, "writing");
-			return 1;
+			// Part i of out.asm is out.i.asm.
+			const char* part_path = output_path;
+			char* split_path = NULL;
+			if (part_count > 1)
+			{
+				const char* slash = strrchr(output_path, '/');
+				const char* dot = strrchr(output_path, '.');
+				size_t stem = (dot != NULL && (slash == NULL || dot > slash + 1)) ? (size_t)(dot - output_path) : strlen(output_path);
+				size_t size = strlen(output_path) + 24;
+				split_path = malloc(size);
+				if (split_path == NULL) crash_alloc_failed();
+				snprintf(split_path, size, "%.*s.%zu%s", (int)stem, output_path, i, output_path + stem);
+				part_path = split_path;
+			}
+			outputs[i] = fopen(part_path, "wb");
+			if (outputs[i] == NULL)
+			{
+				print_file_not_opened(part_path, "writing");
+				return 1;
+			}
+			free(split_path);
+		}
+	}
+
+	// Bytes written are counted as they pass, file positions don't work for pipes.
+	FILE** streams = outputs;
+#if COUNTED_OUTPUT_SUPPORTED
+	if (stats != NULL)
+	{
+		stats->output_bytes = 0;
+		streams = malloc(part_count * sizeof(FILE*));
+		if (streams == NULL) crash_alloc_failed();
+		for (size_t i = 0; i < part_count; i++)
+		{
+			streams[i] = counted_output(outputs[i], &stats->output_bytes);
 		}
 	}
+#endif
 
-	if (!emit_code(flie, output, target))
+	stats_begin(stats, "emit");
+	int emitted = emit_code(flie, streams, part_count, target, profile_path, debug_info ? input_path : NULL, embed_name, shared, compile_threads);
+	for (size_t i = 0; i < part_count; i++)
+	{
+		if (streams != outputs && fclose(streams[i]) != 0) emitted = 0;
+		if (fflush(outputs[i]) != 0) emitted = 0;
+	}
+	if (streams != outputs) free(streams);
+	if (!emitted)
 	{
 		fprintf(stderr, "failed to write to %s: %s", output_path, strerror(errno));
 		return 1;
 	}
-	fclose(output);
-	return 0;
+	stats_end(stats);
+	for (size_t i = 0; i < part_count; i++)
+	{
+		fclose(outputs[i]);
+	}
+	free(outputs);
+	if (header_path != NULL)
+	{
+		FILE* header = fopen(header_path, "w");
+		if (header == NULL)
+		{
+			print_file_not_opened(header_path, "writing");
+			return 1;
+		}
+		if (!emit_embed_header(header, embed_name, shared) || fclose(header) != 0)
+		{
+			fprintf(stderr, "failed to write to %s: %s", header_path, strerror(errno));
+			return 1;
+		}
+	}
+	return finish_stats(stats, trace_path, optimize_loops) ? 0 : 1;
 }
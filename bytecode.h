@@ -0,0 +1,72 @@
+/*
+	MIT License
+
+	Copyright (c) 2024 Ivan
+
+	Permission is hereby granted, free of charge, to any person obtaining a copy
+	of this software and associated documentation files (the "Software"), to deal
+	in the Software without restriction, including without limitation the rights
+	to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+	copies of the Software, and to permit persons to whom the Software is
+	furnished to do so, subject to the following conditions:
+
+	The above copyright notice and this permission notice shall be included in all
+	copies or substantial portions of the Software.
+
+	THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+	IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+	FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+	AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+	LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+	OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+	SOFTWARE.
+*/
+
+// Bytecode written by `brainbrain --bytecode` and run by bbvm.
+//
+// A file is a BYTECODE_HEADER_SIZE byte header:
+//     magic    BYTECODE_MAGIC, 4 bytes
+//     version  u32, BYTECODE_VERSION
+//     tape     u32, number of cells, the pointer wraps around at the end
+//     code     u32, size of the instructions
+//     data     u32, size of the tables used by BC_MAP and BC_PRINT
+// followed by the instructions and the tables. Values are little endian.
+//
+// Instructions are an opcode byte followed by the operands listed next to it.
+// Offsets and shifts are in [0, tape), moving right with wraparound.
+
+#ifndef BYTECODE_H
+#define BYTECODE_H
+
+#define BYTECODE_MAGIC "BBVM"
+#define BYTECODE_VERSION 1
+#define BYTECODE_HEADER_SIZE 20
+
+enum
+{
+	BC_HALT,
+	BC_INC,        // u8 value: adds value to the cell.
+	BC_SHIFT,      // u16 shift: moves the pointer.
+	BC_INC_SHIFT,  // u8 value, u16 shift: BC_INC then BC_SHIFT.
+	BC_CLEAR,      // Sets the cell to 0, from `[-]` and alike.
+	BC_CLEAR_SHIFT, // u16 shift: BC_CLEAR then BC_SHIFT.
+	// u8 count, then count times u16 offset, u8 factor: adds the cell times
+	// factor to the cell at every offset, then clears the cell.
+	BC_MUL,
+	BC_SCAN,       // u16 shift: moves the pointer by shift until the cell is 0.
+	BC_READ,       // Reads a byte into the cell, 0 at the end of input.
+	BC_WRITE,      // Writes the cell.
+	BC_ECHO,       // u8 write_first: `[.,]` if write_first is 1, `[,.]` otherwise.
+	// u32 data offset of u8 lengths[256], u32 offsets[256], then bytes:
+	// until the cell is 0, writes lengths[cell] bytes at offsets[cell]
+	// and reads the cell.
+	BC_MAP,
+	// u32 data offset of u8 inc, u16 count, u8 deltas[count]:
+	// writes the cell plus every delta, then adds inc to the cell.
+	BC_PRINT,
+	BC_JZ,         // u32 target: jumps to target if the cell is 0.
+	BC_JNZ,        // u32 target: jumps to target if the cell is not 0.
+	BC_COUNT,
+};
+
+#endif
@@ -0,0 +1,2 @@
+Copies input to output up to the first zero byte or the end of input
+,[.,]
@@ -0,0 +1,90 @@
+# Compiles SOURCE with --embed, with and without optimizations, links it into
+# HOST and fails if its output differs from the interpreter's on any input
+# written by make_inputs. If SHARED is set, SOURCE is built as a shared
+# library with --shared and passed to HOST as its argument instead.
+#
+# Expects BRAINBRAIN, MAKE_INPUTS, NASM, CC, HOST, SOURCE and WORK_DIR.
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+execute_process(COMMAND "${MAKE_INPUTS}" "${WORK_DIR}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "make_inputs failed")
+endif()
+
+foreach(level O1 O0)
+	set(flags --embed=program --header=${WORK_DIR}/program.h)
+	if(level STREQUAL "O0")
+		list(APPEND flags -O0)
+	endif()
+	if(SHARED)
+		list(APPEND flags --shared)
+	endif()
+	execute_process(
+		COMMAND "${BRAINBRAIN}" ${flags} -o "${WORK_DIR}/${level}.asm" "${SOURCE}"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain ${flags} failed")
+	endif()
+	execute_process(
+		COMMAND "${NASM}" -f elf64 -o "${WORK_DIR}/${level}.o" "${WORK_DIR}/${level}.asm"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "nasm failed on ${level}.asm")
+	endif()
+	if(SHARED)
+		execute_process(
+			COMMAND "${CC}" -shared -o "${WORK_DIR}/${level}.so" "${WORK_DIR}/${level}.o"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "linking ${level}.so failed")
+		endif()
+		set(${level}_command "${WORK_DIR}/host" "${WORK_DIR}/${level}.so")
+	else()
+		execute_process(
+			COMMAND "${CC}" -I "${WORK_DIR}" -o "${WORK_DIR}/${level}" "${HOST}" "${WORK_DIR}/${level}.o"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "linking ${level}.o failed")
+		endif()
+		set(${level}_command "${WORK_DIR}/${level}")
+	endif()
+endforeach()
+if(SHARED)
+	execute_process(
+		COMMAND "${CC}" -I "${WORK_DIR}" -pthread -o "${WORK_DIR}/host" "${HOST}" -ldl
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "building the host failed")
+	endif()
+endif()
+
+foreach(input zero eof large)
+	execute_process(
+		COMMAND "${BRAINBRAIN}" --interpret "${SOURCE}"
+		INPUT_FILE "${WORK_DIR}/${input}.txt"
+		OUTPUT_FILE "${WORK_DIR}/${input}.expected.out"
+		TIMEOUT 60
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain --interpret failed on ${input}.txt: ${result}")
+	endif()
+	foreach(level O1 O0)
+		execute_process(
+			COMMAND ${${level}_command}
+			INPUT_FILE "${WORK_DIR}/${input}.txt"
+			OUTPUT_FILE "${WORK_DIR}/${input}.${level}.out"
+			TIMEOUT 60
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "${level} failed on ${input}.txt: ${result}")
+		endif()
+		execute_process(
+			COMMAND "${CMAKE_COMMAND}" -E compare_files
+				"${WORK_DIR}/${input}.expected.out" "${WORK_DIR}/${input}.${level}.out"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "Embedded ${level} output differs on ${input}.txt")
+		endif()
+	endforeach()
+endforeach()
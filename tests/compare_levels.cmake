@@ -0,0 +1,57 @@
+# Compiles SOURCE with and without optimizations, runs both programs on every
+# input written by make_inputs and fails if their outputs differ.
+#
+# Expects BRAINBRAIN, MAKE_INPUTS, NASM, CC, SOURCE and WORK_DIR.
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+execute_process(COMMAND "${MAKE_INPUTS}" "${WORK_DIR}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "make_inputs failed")
+endif()
+
+foreach(level O1 O0)
+	set(flags)
+	if(level STREQUAL "O0")
+		set(flags -O0)
+	endif()
+	execute_process(
+		COMMAND "${BRAINBRAIN}" ${flags} -o "${WORK_DIR}/${level}.asm" "${SOURCE}"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain ${flags} failed")
+	endif()
+	execute_process(
+		COMMAND "${NASM}" -f elf64 -o "${WORK_DIR}/${level}.o" "${WORK_DIR}/${level}.asm"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "nasm failed on ${level}.asm")
+	endif()
+	execute_process(
+		COMMAND "${CC}" -o "${WORK_DIR}/${level}" "${WORK_DIR}/${level}.o"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "linking ${level}.o failed")
+	endif()
+endforeach()
+
+foreach(input zero eof large)
+	foreach(level O1 O0)
+		execute_process(
+			COMMAND "${WORK_DIR}/${level}"
+			INPUT_FILE "${WORK_DIR}/${input}.txt"
+			OUTPUT_FILE "${WORK_DIR}/${input}.${level}.out"
+			TIMEOUT 60
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "${level} failed on ${input}.txt: ${result}")
+		endif()
+	endforeach()
+	execute_process(
+		COMMAND "${CMAKE_COMMAND}" -E compare_files
+			"${WORK_DIR}/${input}.O1.out" "${WORK_DIR}/${input}.O0.out"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "Optimized output differs on ${input}.txt")
+	endif()
+endforeach()
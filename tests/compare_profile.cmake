@@ -0,0 +1,94 @@
+# Compiles SOURCE with --profile and runs it without input, so that loops
+# that depend on input never run, then compiles it again with --use-profile,
+# which moves them out of line. Fails if code of those loops ends up outside
+# of .text.unlikely, or if the output differs from the interpreter's on any
+# input written by make_inputs.
+#
+# Expects BRAINBRAIN, MAKE_INPUTS, NASM, CC, SOURCE and WORK_DIR.
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+execute_process(COMMAND "${MAKE_INPUTS}" "${WORK_DIR}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "make_inputs failed")
+endif()
+file(WRITE "${WORK_DIR}/empty.txt" "")
+
+foreach(stage profile use)
+	if(stage STREQUAL "profile")
+		set(flags --profile=${WORK_DIR}/program.profile)
+	else()
+		set(flags --use-profile=${WORK_DIR}/program.profile)
+	endif()
+	execute_process(
+		COMMAND "${BRAINBRAIN}" ${flags} -o "${WORK_DIR}/${stage}.asm" "${SOURCE}"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain ${flags} failed")
+	endif()
+	execute_process(
+		COMMAND "${NASM}" -f elf64 -o "${WORK_DIR}/${stage}.o" "${WORK_DIR}/${stage}.asm"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "nasm failed on ${stage}.asm")
+	endif()
+	execute_process(
+		COMMAND "${CC}" -o "${WORK_DIR}/${stage}" "${WORK_DIR}/${stage}.o"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "linking ${stage}.o failed")
+	endif()
+	if(stage STREQUAL "profile")
+		execute_process(
+			COMMAND "${WORK_DIR}/profile"
+			INPUT_FILE "${WORK_DIR}/empty.txt"
+			OUTPUT_QUIET
+			TIMEOUT 60
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "profile failed: ${result}")
+		endif()
+	endif()
+endforeach()
+
+# Cold loops come last in .text.unlikely, up to the switch back to .text.
+file(READ "${WORK_DIR}/use.asm" assembly)
+string(FIND "${assembly}" "\n..@cold_" cold_start)
+if(cold_start EQUAL -1)
+	message(FATAL_ERROR "No loop of ${SOURCE} was moved out of line")
+endif()
+string(SUBSTRING "${assembly}" ${cold_start} -1 cold)
+string(FIND "${cold}" "\nsection .text\n" cold_end)
+string(SUBSTRING "${cold}" 0 ${cold_end} cold)
+string(REGEX MATCH "\nsection \\.rodata\n[^\n]*\n[^\n]*\n[^\n]*\nsection [^\n]*" data "${cold}")
+if(NOT data MATCHES "section \\.text\\.unlikely$")
+	message(FATAL_ERROR "Data in a cold loop doesn't return to .text.unlikely: ${data}")
+endif()
+
+foreach(input zero eof large)
+	execute_process(
+		COMMAND "${BRAINBRAIN}" --interpret "${SOURCE}"
+		INPUT_FILE "${WORK_DIR}/${input}.txt"
+		OUTPUT_FILE "${WORK_DIR}/${input}.expected.out"
+		TIMEOUT 60
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain --interpret failed on ${input}.txt: ${result}")
+	endif()
+	execute_process(
+		COMMAND "${WORK_DIR}/use"
+		INPUT_FILE "${WORK_DIR}/${input}.txt"
+		OUTPUT_FILE "${WORK_DIR}/${input}.use.out"
+		TIMEOUT 60
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "use failed on ${input}.txt: ${result}")
+	endif()
+	execute_process(
+		COMMAND "${CMAKE_COMMAND}" -E compare_files
+			"${WORK_DIR}/${input}.expected.out" "${WORK_DIR}/${input}.use.out"
+		RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "--use-profile output differs on ${input}.txt")
+	endif()
+endforeach()
@@ -0,0 +1,67 @@
+# Runs SOURCE in process with and without optimizations, compiled and
+# interpreted, and as bytecode in bbvm, on every input written by
+# make_inputs and fails if any of the outputs differ.
+#
+# Expects BRAINBRAIN, BBVM, MAKE_INPUTS, SOURCE and WORK_DIR.
+
+file(REMOVE_RECURSE "${WORK_DIR}")
+file(MAKE_DIRECTORY "${WORK_DIR}")
+execute_process(COMMAND "${MAKE_INPUTS}" "${WORK_DIR}" RESULT_VARIABLE result)
+if(NOT result EQUAL 0)
+	message(FATAL_ERROR "make_inputs failed")
+endif()
+foreach(level O1 O0)
+	set(flags --bytecode -o "${WORK_DIR}/${level}.bbc")
+	if(level STREQUAL "O0")
+		list(APPEND flags -O0)
+	endif()
+	execute_process(COMMAND "${BRAINBRAIN}" ${flags} "${SOURCE}" RESULT_VARIABLE result)
+	if(NOT result EQUAL 0)
+		message(FATAL_ERROR "brainbrain ${flags} failed: ${result}")
+	endif()
+endforeach()
+
+foreach(input zero eof large)
+	foreach(mode run interpret)
+		foreach(level O1 O0)
+			set(flags --${mode})
+			if(level STREQUAL "O0")
+				list(APPEND flags -O0)
+			endif()
+			execute_process(
+				COMMAND "${BRAINBRAIN}" ${flags} "${SOURCE}"
+				INPUT_FILE "${WORK_DIR}/${input}.txt"
+				OUTPUT_FILE "${WORK_DIR}/${input}.${mode}.${level}.out"
+				TIMEOUT 60
+				RESULT_VARIABLE result)
+			if(NOT result EQUAL 0)
+				message(FATAL_ERROR "brainbrain ${flags} failed on ${input}.txt: ${result}")
+			endif()
+			execute_process(
+				COMMAND "${CMAKE_COMMAND}" -E compare_files
+					"${WORK_DIR}/${input}.run.O1.out" "${WORK_DIR}/${input}.${mode}.${level}.out"
+				RESULT_VARIABLE result)
+			if(NOT result EQUAL 0)
+				message(FATAL_ERROR "brainbrain ${flags} output differs on ${input}.txt")
+			endif()
+		endforeach()
+	endforeach()
+	foreach(level O1 O0)
+		execute_process(
+			COMMAND "${BBVM}" "${WORK_DIR}/${level}.bbc"
+			INPUT_FILE "${WORK_DIR}/${input}.txt"
+			OUTPUT_FILE "${WORK_DIR}/${input}.bbvm.${level}.out"
+			TIMEOUT 60
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "bbvm ${level}.bbc failed on ${input}.txt: ${result}")
+		endif()
+		execute_process(
+			COMMAND "${CMAKE_COMMAND}" -E compare_files
+				"${WORK_DIR}/${input}.run.O1.out" "${WORK_DIR}/${input}.bbvm.${level}.out"
+			RESULT_VARIABLE result)
+		if(NOT result EQUAL 0)
+			message(FATAL_ERROR "bbvm ${level}.bbc output differs on ${input}.txt")
+		endif()
+	endforeach()
+endforeach()
@@ -0,0 +1,32 @@
+#include <stdio.h>
+
+#include "program.h"
+
+// Runs the program emitted by --embed=program on stdin and stdout,
+// after checking that it refuses a tape that is too small.
+typedef struct Streams Streams;
+struct Streams
+{
+	FILE* in;
+	FILE* out;
+};
+
+static size_t read_in(void* context, uint8_t* buffer, size_t size)
+{
+	return fread(buffer, 1, size, ((Streams*)context)->in);
+}
+
+static int write_out(void* context, const uint8_t* buffer, size_t size)
+{
+	return fwrite(buffer, 1, size, ((Streams*)context)->out) != size;
+}
+
+int main(void)
+{
+	Streams streams = { .in = stdin, .out = stdout };
+	bf_io io = { .context = &streams, .read = read_in, .write = write_out };
+	static uint8_t tape[BF_TAPE_SIZE];
+	if (bf_program(tape, BF_TAPE_SIZE - 1, &io) != BF_ERROR_TAPE) return 1;
+	if (bf_program(tape, BF_TAPE_SIZE, &io) != BF_OK) return 1;
+	return fflush(stdout) != 0;
+}
@@ -0,0 +1,34 @@
+#include <stdio.h>
+#include <string.h>
+
+// Writes the inputs used to compare optimized and unoptimized programs:
+// text ending in a zero byte, text ending at EOF, and text larger than
+// the 64 KiB input buffer of the generated code.
+static int write_file(const char* dir, const char* name, const char* data, size_t size, size_t repeat)
+{
+	char path[4096];
+	if (snprintf(path, sizeof(path), "%s/%s", dir, name) >= (int)sizeof(path)) return 0;
+	FILE* file = fopen(path, "wb");
+	if (file == NULL) return 0;
+	for (size_t i = 0; i < repeat; i++)
+	{
+		if (fwrite(data, 1, size, file) != size) return 0;
+	}
+	return fclose(file) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "Usage: %s <directory>\n", argv[0]);
+		return 1;
+	}
+	static const char zero[] = "zero terminated\n\0left over after the zero\n";
+	static const char eof[] = "no zero before the end of input\n";
+	static const char line[] = "The quick brown fox jumps over the lazy dog.\n";
+	if (!write_file(argv[1], "zero.txt", zero, sizeof(zero) - 1, 1)) return 1;
+	if (!write_file(argv[1], "eof.txt", eof, strlen(eof), 1)) return 1;
+	if (!write_file(argv[1], "large.txt", line, strlen(line), 4096)) return 1;
+	return 0;
+}
@@ -0,0 +1,111 @@
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "program.h"
+
+// Loads the module built with --embed=program --shared given as the argument,
+// runs it on stdin from several threads at once and writes the output to
+// stdout, failing if the threads disagree.
+#define THREAD_COUNT 4
+
+typedef struct Buffer Buffer;
+struct Buffer
+{
+	uint8_t* bytes;
+	size_t size;
+	size_t capacity;
+	size_t position;
+};
+
+typedef struct Job Job;
+struct Job
+{
+	bf_run_fn* run;
+	Buffer in;
+	Buffer out;
+	int result;
+};
+
+static int buffer_append(Buffer* buffer, const uint8_t* bytes, size_t size)
+{
+	if (buffer->size + size > buffer->capacity)
+	{
+		size_t capacity = (buffer->capacity == 0) ? 4096 : buffer->capacity;
+		while (capacity < buffer->size + size) capacity *= 2;
+		uint8_t* grown = realloc(buffer->bytes, capacity);
+		if (grown == NULL) return 0;
+		buffer->bytes = grown;
+		buffer->capacity = capacity;
+	}
+	memcpy(buffer->bytes + buffer->size, bytes, size);
+	buffer->size += size;
+	return 1;
+}
+
+static size_t read_job(void* context, uint8_t* buffer, size_t size)
+{
+	Buffer* in = &((Job*)context)->in;
+	if (size > in->size - in->position) size = in->size - in->position;
+	memcpy(buffer, in->bytes + in->position, size);
+	in->position += size;
+	return size;
+}
+
+static int write_job(void* context, const uint8_t* buffer, size_t size)
+{
+	return !buffer_append(&((Job*)context)->out, buffer, size);
+}
+
+static void* run_job(void* argument)
+{
+	Job* job = argument;
+	uint8_t* tape = calloc(BF_TAPE_SIZE, 1);
+	if (tape == NULL) return NULL;
+	bf_io io = { .context = job, .read = read_job, .write = write_job };
+	job->result = job->run(tape, BF_TAPE_SIZE, &io);
+	free(tape);
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2) return 1;
+	void* module = dlopen(argv[1], RTLD_NOW | RTLD_LOCAL);
+	if (module == NULL)
+	{
+		fprintf(stderr, "%s\n", dlerror());
+		return 1;
+	}
+	bf_init_fn* init = (bf_init_fn*)dlsym(module, "bf_init");
+	bf_run_fn* run = (bf_run_fn*)dlsym(module, "bf_run");
+	size_t tape_size = 0;
+	if (init == NULL || run == NULL) return 1;
+	if (init(BF_ABI_VERSION + 1, NULL) != BF_ERROR_ABI) return 1;
+	if (init(BF_ABI_VERSION, &tape_size) != BF_OK || tape_size != BF_TAPE_SIZE) return 1;
+
+	Buffer input = {0};
+	uint8_t chunk[4096];
+	size_t count;
+	while ((count = fread(chunk, 1, sizeof(chunk), stdin)) != 0)
+	{
+		if (!buffer_append(&input, chunk, count)) return 1;
+	}
+	Job jobs[THREAD_COUNT];
+	pthread_t threads[THREAD_COUNT];
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		jobs[i] = (Job){ .run = run, .in = input, .result = -1 };
+		if (pthread_create(&threads[i], NULL, run_job, &jobs[i]) != 0) return 1;
+	}
+	for (size_t i = 0; i < THREAD_COUNT; i++)
+	{
+		if (pthread_join(threads[i], NULL) != 0 || jobs[i].result != BF_OK) return 1;
+		if (jobs[i].out.size != jobs[0].out.size) return 1;
+		if (jobs[i].out.size != 0 && memcmp(jobs[i].out.bytes, jobs[0].out.bytes, jobs[0].out.size) != 0) return 1;
+	}
+	if (fwrite(jobs[0].out.bytes, 1, jobs[0].out.size, stdout) != jobs[0].out.size) return 1;
+	return fflush(stdout) != 0;
+}